@@ -0,0 +1,22 @@
+// Payload compression header.
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+// Compression methods
+#define COMPRESSION_NONE 0  /* Payloads sent as they are */
+#define COMPRESSION_LZ 1    /* LZ77 with byte-aligned sequences (LZ4 style) */
+
+// Compress len bytes of in into out. A sequence is a token (literal
+// length, match length - 4), the literals, a 2 byte offset and the match;
+// lengths of 15 and more go on in extra bytes. Matches may overlap their
+// copy, so a run of one byte takes a handful of bytes.
+// Returns the compressed size, or -1 if it would not fit in capacity bytes.
+int compressBlock(const unsigned char *in, int len, unsigned char *out, int capacity);
+
+// Decompress len bytes of in into out.
+// Returns the decompressed size, or -1 if the block is malformed or
+// longer than capacity bytes.
+int decompressBlock(const unsigned char *in, int len, unsigned char *out, int capacity);
+
+#endif // _COMPRESS_H_
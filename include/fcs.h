@@ -0,0 +1,34 @@
+// Frame check sequence header.
+
+#ifndef _FCS_H_
+#define _FCS_H_
+
+// FCS types
+#define FCS_XOR 0       /* Original single byte XOR (BCC2) */
+#define FCS_CRC16 1     /* CRC-16-CCITT as used by HDLC (X.25), 2 bytes */
+#define FCS_CRC32 2     /* CRC-32 (IEEE 802.3), 4 bytes */
+#define FCS_CRC32C 3    /* CRC-32C (Castagnoli), 4 bytes, SSE4.2 when available */
+
+#define FCS_MAX_SIZE 4
+
+// Number of FCS bytes sent after the payload.
+int fcsSize(int type);
+
+// Initial checksum state.
+unsigned int fcsInit(int type);
+
+// Update the checksum state with len bytes of data.
+unsigned int fcsUpdate(int type, unsigned int state, const unsigned char *data, int len);
+
+// Write the FCS of a payload whose final state is state into out
+// (fcsSize(type) bytes, least significant first).
+void fcsStore(int type, unsigned int state, unsigned char *out);
+
+// Check the state after running over a payload followed by its FCS.
+// Returns TRUE (1) if the frame is valid.
+int fcsCheck(int type, unsigned int state);
+
+// Name of the implementation used for type ("slice-by-8", "sse4.2", ...).
+const char *fcsEngine(int type);
+
+#endif // _FCS_H_
@@ -0,0 +1,40 @@
+// Forward error correction header.
+
+#ifndef _FEC_H_
+#define _FEC_H_
+
+// FEC types
+#define FEC_NONE 0      /* No parity, errors are recovered by retransmission */
+#define FEC_RS 1        /* Reed-Solomon RS(255,223) over GF(256), interleaved */
+
+#define FEC_DATA 223    /* Data bytes per RS codeword */
+#define FEC_PARITY 32   /* Parity bytes per RS codeword, corrects 16 byte errors */
+
+// Most parity bytes fecSize() returns for len bytes of data
+#define FEC_MAX_SIZE(len) ( ((len) + FEC_DATA - 1) / FEC_DATA * FEC_PARITY )
+
+// Number of parity bytes sent after len bytes of data (payload and FCS).
+// The data is split into ceil(len / 223) codewords, byte i going to
+// codeword i % codewords, so a burst of errors is spread over all of them.
+int fecSize(int type, int len);
+
+// Incremental encoder: the data can be fed in several pieces.
+typedef struct {
+    int codewords;          /* Number of interleaved codewords */
+    int index;              /* Data bytes encoded so far */
+    unsigned char *parity;  /* Parity registers, fecSize() bytes */
+} fec_encoder;
+
+// Start encoding len bytes of data whose parity goes to parity.
+void fecEncodeInit(fec_encoder *e, int len, unsigned char *parity);
+
+// Encode the next len bytes of data.
+void fecEncodeUpdate(fec_encoder *e, const unsigned char *data, int len);
+
+// Correct a received block of size bytes (data followed by its parity) in
+// place and store the length of the data in *len.
+// Returns the number of data bytes corrected, or -1 if some codeword has
+// more errors than it can correct.
+int fecDecode(int type, unsigned char *block, int size, int *len);
+
+#endif // _FEC_H_
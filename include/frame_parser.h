@@ -0,0 +1,82 @@
+// Frame parser header.
+
+#ifndef _FRAME_PARSER_H_
+#define _FRAME_PARSER_H_
+
+#include "stuffing.h"
+
+// Control octet classes, one per octet value in frame_parser.control
+#define CTRL_CLASS_NONE 0   /* Not a control octet, the header is dropped */
+#define CTRL_CLASS_SHORT 1  /* FLAG A C BCC1 */
+#define CTRL_CLASS_LONG 2   /* FLAG A C N BCC1, with N below the modulo */
+#define CTRL_CLASS_PAIR 8   /* FLAG A C N(S) N(R) BCC1, both below the modulo */
+#define CTRL_CLASS_DATA 4   /* Or-ed in: a data field follows BCC1 */
+
+// A received frame
+typedef struct {
+    unsigned char a;        /* Address */
+    unsigned char c;        /* Control octet */
+    unsigned char n;        /* Sequence octet, 0 with a single control octet */
+    unsigned char nr;       /* Second sequence octet of a CTRL_CLASS_PAIR frame, else 0 */
+    int data;               /* The frame has a data field */
+    int received;           /* The data field was destuffed, not skipped */
+    unsigned char *buffer;  /* Where the data field was destuffed */
+    int size;               /* Destuffed data field size, FCS included */
+    unsigned int check;     /* Frame check state after the data field */
+} frame_info;
+
+typedef enum {
+    PARSE_MORE,             /* Input used up, no complete frame yet */
+    PARSE_HEADER,           /* Header with a data field passed BCC1: call
+                               parserReceive() or parserSkip() */
+    PARSE_FRAME             /* Complete frame in frame */
+} parse_status;
+
+// One DFA for every frame type: FLAG A C [N(S) [N(R)]] BCC1, then the closing FLAG
+// or a stuffed data field up to it. The header octets after the FLAG are
+// ESC-stuffed in every framing mode.
+typedef struct {
+    unsigned char address[256];     /* Non-zero for the accepted address octets */
+    unsigned char control[256];     /* CTRL_CLASS_* of every control octet */
+    int modulo;                     /* Sequence octets must be below it */
+    int fcs;                        /* Frame check run over data fields */
+
+    int state;
+    unsigned char bcc;              /* Expected BCC1 */
+    int escape;                     /* Last header octet was ESC */
+    frame_info frame;               /* Frame being parsed, complete after PARSE_FRAME */
+    destuffer data;
+
+    unsigned long frames;           /* Complete frames */
+    unsigned long header_errors;    /* Headers failing BCC1 */
+    unsigned long overflows;        /* Data fields too long for their buffer */
+    unsigned long resyncs;          /* Times the parser lost the frame and hunted for a FLAG */
+    unsigned long long discarded;   /* Bytes thrown away while hunting for a FLAG */
+    unsigned long long parse_ns;    /* Time spent in parseFrame(), with LINK_PROFILE */
+} frame_parser;
+
+// Reset p for a link with the given sequence modulo and FCS type. Every
+// address and control octet is rejected until the caller fills address[]
+// and control[].
+void parserInit(frame_parser *p, int modulo, int fcs);
+
+// Drop any partial frame and hunt for the next FLAG.
+void parserReset(frame_parser *p);
+
+// Parse received bytes until a frame or I-frame header is complete.
+// Returns the number of bytes consumed from in and stores the outcome in status.
+int parseFrame(frame_parser *p, const unsigned char *in, int len, parse_status *status);
+
+// After PARSE_HEADER: destuff the data field, framed as framing says
+// (stuffing.h), into out (capacity bytes).
+void parserReceive(frame_parser *p, unsigned char *out, int capacity, int framing);
+
+// After PARSE_HEADER: skip the data field up to the closing FLAG.
+void parserSkip(frame_parser *p);
+
+// Frames parsed per second of time spent in parseFrame(), 0 if none yet
+// or if built without LINK_PROFILE, which times every call. bench_parser
+// measures it without the timing overhead.
+double parserThroughput(const frame_parser *p);
+
+#endif // _FRAME_PARSER_H_
@@ -4,6 +4,8 @@
 #ifndef _LINK_LAYER_H_
 #define _LINK_LAYER_H_
 
+#include <sys/uio.h>
+
 typedef enum
 {
     LlTx,
@@ -21,7 +23,7 @@ typedef struct
 
 // SIZE of maximum acceptable payload.
 // Maximum number of bytes that application layer should send to link layer
-#define MAX_PAYLOAD_SIZE 1000
+#define MAX_PAYLOAD_SIZE 4096
 
 // MISC
 #define FALSE 0
@@ -31,17 +33,65 @@ typedef struct
 // Return "1" on success or "-1" on error.
 int llopen(LinkLayer connectionParameters);
 
+// Open a connection like llopen, the transmitter sending packet, the
+// first one, in the SET when the receiver supports it. Its llread returns
+// it first. Otherwise, or if it is longer than 1024 bytes, llwrite sends it.
+// Return "1" on success or "-1" on error.
+int llopenWith(LinkLayer connectionParameters, const unsigned char *packet, int packetSize);
+
 // Send data in buf with size bufSize.
 // Return number of chars written, or "-1" on error.
 int llwrite(const unsigned char *buf, int bufSize);
 
+// Send count packets, packing consecutive ones in one frame, each behind
+// its length, while they fit in llpayloadsize(). llread returns them one
+// by one. Unless both ends support it, every packet gets its own frame.
+// Return number of chars written, or "-1" on error.
+int llwritev(const struct iovec *packets, int count);
+
+// Payload size llwrite should be given now, at most MAX_PAYLOAD_SIZE.
+// Grows while frames are acknowledged and shrinks after rejects and timeouts.
+int llpayloadsize();
+
 // Receive data in packet.
-// Return number of chars read, or "-1" on error.
+// Return number of chars read, or "-1" on error or if llreadAsync reads are pending.
 int llread(unsigned char *packet);
 
+// Completion of an asynchronous request. result is what llwrite or llread
+// would have returned.
+typedef void (*LinkLayerCallback)(void *arg, int result);
+
+// Queue buf to be sent and return at once. buf must stay untouched until
+// done runs, once the frame is acknowledged. Requests go out in order and
+// should not be mixed with llwrite.
+// Return 0 if queued, or "-1" if too many requests are pending or the link failed.
+int llwriteAsync(const unsigned char *buf, int bufSize, LinkLayerCallback done, void *arg);
+
+// Queue packet to receive the next packet and return at once. done runs
+// once it is filled. llread fails while such reads are pending, and this
+// fails while llread waits.
+// Return 0 if queued, or "-1" if too many requests are pending or llread waits.
+int llreadAsync(unsigned char *packet, LinkLayerCallback done, void *arg);
+
+// Descriptor that becomes readable when llpoll has callbacks to run, for
+// an event loop polling other descriptors too. "-1" if there is none.
+int llfd();
+
+// Run the callbacks of the completed requests, on the calling thread,
+// waiting up to timeoutMs for one (-1: forever, 0: no wait).
+// Return the number of callbacks run, or "-1" on error.
+int llpoll(int timeoutMs);
+
 // Close previously opened connection.
 // if showStatistics == TRUE, link layer should print statistics in the console on close.
 // Return "1" on success or "-1" on error.
 int llclose(int showStatistics);
 
+// Close the connection like llclose, the transmitter sending packet, the
+// last one, in the DISC when the receiver supports it. Its llread returns
+// it before reporting the disconnection. Otherwise, or if it is longer
+// than 1024 bytes, llwrite sends it first.
+// Return "1" on success or "-1" on error.
+int llcloseWith(int showStatistics, const unsigned char *packet, int packetSize);
+
 #endif // _LINK_LAYER_H_
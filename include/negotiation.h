@@ -0,0 +1,70 @@
+// Link parameter negotiation header.
+
+#ifndef _NEGOTIATION_H_
+#define _NEGOTIATION_H_
+
+// Parameter block carried in the data field of SET and UA: a list of
+// type, length, value entries (values big-endian) followed by a CRC-16.
+// Unknown types are skipped, so newer stations can add entries.
+#define NEG_ARQ 1           /* Mask of ARQ modes */
+#define NEG_SEQ_BITS 2      /* Largest sequence number size in bits */
+#define NEG_WINDOW 3        /* Largest transmit window */
+#define NEG_MAX_PAYLOAD 4   /* Longest I-frame payload, 2 octets */
+#define NEG_FCS 5           /* Mask of FCS types (fcs.h) */
+#define NEG_FEC 6           /* Mask of FEC types (fec.h) */
+#define NEG_COMPRESSION 7   /* Mask of payload compression methods, bit 0: none */
+#define NEG_FRAMING 8       /* Mask of data field framings (stuffing.h) */
+#define NEG_SCRAMBLING 9    /* Mask of payload scrambling methods (stuffing.h) */
+#define NEG_BATCHING 10     /* Mask of I-frame batching methods, bit 0: one packet per frame */
+#define NEG_HANDSHAKE_DATA 11   /* Mask of handshake data methods, bit 1: a packet rides in SET and DISC */
+#define NEG_DATA 12         /* Up to NEG_DATA_CHUNK octets of that packet, the entries in order */
+#define NEG_KEEPALIVE 13    /* Mask of keepalive methods, bit 1: PROBE frames answered with an RR */
+
+#define NEG_DATA_CHUNK 255  /* Longest NEG_DATA entry */
+#define NEG_DATA_MAX 1024   /* Longest packet carried by a handshake */
+#define NEGOTIATION_MAX_SIZE ( 48 + NEG_DATA_MAX + 2 * ((NEG_DATA_MAX + NEG_DATA_CHUNK - 1) / NEG_DATA_CHUNK) )
+
+// Parameters a station supports, or the ones agreed on. Every mask has
+// bit v set for each value v accepted.
+typedef struct {
+    unsigned int arq;
+    unsigned int fcs;
+    unsigned int fec;
+    unsigned int compression;
+    unsigned int framing;
+    unsigned int scrambling;
+    unsigned int batching;
+    unsigned int handshake_data;
+    unsigned int keepalive;
+    int seq_bits;
+    int window;
+    int max_payload;
+} link_params;
+
+// Write the parameter block of p, if not NULL, and the size bytes of data,
+// if not NULL, into out (NEGOTIATION_MAX_SIZE bytes).
+// Returns its size.
+int paramsEncode(const link_params *p, const unsigned char *data, int size, unsigned char *out);
+
+// Read a parameter block. Entries missing from it leave p unchanged.
+// Returns -1 if the block is damaged or holds values out of range.
+int paramsDecode(link_params *p, const unsigned char *in, int len);
+
+// Copy the data carried by a block into out (NEG_DATA_MAX bytes).
+// Returns its size, or -1 if the block is damaged or holds none.
+int paramsData(const unsigned char *in, int len, unsigned char *out);
+
+// Pick one value of every parameter both stations support: the highest
+// ARQ mode, FCS type, compression, framing, scrambling, batching,
+// handshake data and keepalive methods (numbered from the slowest or
+// weakest up), the lowest FEC type (parity costs bandwidth, so it is only
+// used when one end leaves FEC_NONE out), and the smallest sequence size,
+// window and payload.
+// agreed gets single-bit masks.
+// Returns -1 if some parameter has no value in common.
+int paramsAgree(const link_params *local, const link_params *peer, link_params *agreed);
+
+// Value selected by a single-bit mask
+int paramsValue(unsigned int mask);
+
+#endif // _NEGOTIATION_H_
@@ -0,0 +1,42 @@
+// Packet ring header.
+
+#ifndef _PACKET_RING_H_
+#define _PACKET_RING_H_
+
+#include <stdatomic.h>
+
+// Lock-free ring of packets between one producer thread and one consumer
+// thread. Each side only writes its own index, published with release
+// ordering after the slot it covers is written or read.
+typedef struct {
+    unsigned char *data;        /* slots * slot_size bytes */
+    int *sizes;                 /* Packet size of every slot */
+    int slots;                  /* A power of two */
+    int slot_size;
+    atomic_uint head;           /* Next slot popped, written by the consumer */
+    atomic_uint tail;           /* Next slot filled, written by the producer */
+} packet_ring;
+
+// Allocate a ring of slots (rounded up to a power of two) packets of up
+// to slot_size bytes. Returns -1 if it cannot be allocated.
+int ringInit(packet_ring *r, int slots, int slot_size);
+
+// Free the ring buffers.
+void ringFree(packet_ring *r);
+
+// Packets waiting in the ring.
+int ringCount(packet_ring *r);
+
+// Producer: slot the next packet is written to, NULL if the ring is full.
+unsigned char *ringSlot(packet_ring *r);
+
+// Producer: publish the packet of size bytes written to ringSlot().
+void ringPush(packet_ring *r, int size);
+
+// Consumer: oldest packet and its size, NULL if the ring is empty.
+const unsigned char *ringFront(packet_ring *r, int *size);
+
+// Consumer: release the packet returned by ringFront().
+void ringPop(packet_ring *r);
+
+#endif // _PACKET_RING_H_
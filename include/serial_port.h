@@ -4,6 +4,8 @@
 #ifndef _SERIAL_PORT_H_
 #define _SERIAL_PORT_H_
 
+#include <sys/uio.h>
+
 // Open and configure the serial port.
 // Returns -1 on error.
 int openSerialPort(const char *serialPort, int baudRate);
@@ -17,9 +19,45 @@ int closeSerialPort();
 // Returns -1 on error, 0 if no byte was received, 1 if a byte was received.
 int readByte(char *byte);
 
+// Buffered receive. Each refill pulls every byte available on the serial
+// port into an internal buffer with a single read() call.
+
+// Get the buffered bytes, refilling the buffer from the serial port if it is
+// empty. *span points to the bytes until consumeBuffered() is called.
+// Returns -1 on error, otherwise the number of bytes available at *span.
+int readBuffered(const unsigned char **span);
+
+// Drop the first n bytes returned by readBuffered().
+void consumeBuffered(int n);
+
+// Number of received bytes waiting in the buffer, read() not called.
+int bufferedBytes();
+
+// Same as readByte(), served from the receive buffer.
+// Returns -1 on error, 0 if no byte was received, 1 if a byte was received.
+int readBufferedByte(char *byte);
+
+// Number of read() calls made for the receive buffer, how many of them
+// returned data and the total number of bytes they returned.
+void serialReadStats(unsigned long *calls, unsigned long *filled, unsigned long *bytes);
+
+// Flags returned by waitReadable()
+#define PORT_READABLE 1     /* Received bytes are waiting */
+#define EVENT_READABLE 2    /* The extra descriptor is readable */
+
+// Sleep in poll() until the serial port has bytes to read or, if eventFd is
+// not -1, until eventFd becomes readable. timeoutMs < 0 waits forever.
+// Returns -1 on error, 0 on timeout, otherwise PORT_READABLE | EVENT_READABLE flags.
+int waitReadable(int eventFd, int timeoutMs);
+
 // Write up to numBytes to the serial port (must check how many were actually
 // written in the return value).
 // Returns -1 on error, otherwise the number of bytes written.
 int writeBytes(const char *bytes, int numBytes);
 
+// Gather write of iovcnt buffers (at most IOV_MAX) in a single call (must
+// check how many bytes were actually written in the return value).
+// Returns -1 on error, otherwise the number of bytes written.
+int writeVector(const struct iovec *iov, int iovcnt);
+
 #endif // _SERIAL_PORT_H_
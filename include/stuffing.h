@@ -0,0 +1,99 @@
+// Byte stuffing engine header.
+
+#ifndef _STUFFING_H_
+#define _STUFFING_H_
+
+#include <sys/uio.h>
+
+// Framing of the data field
+#define FRAMING_ESCAPE 0    /* FLAG and ESC escaped as ESC, byte ^ 0x20: up to 100% overhead */
+#define FRAMING_COBS 1      /* Consistent Overhead Byte Stuffing: at most 1 byte per 254 */
+
+// Payload scrambling before escape stuffing
+#define SCRAMBLING_NONE 0   /* Payloads stuffed as they are */
+#define SCRAMBLING_XOR 1    /* Payloads XOR-ed with the mask that leaves the fewest bytes to escape */
+
+// Longest COBS encoding of len bytes
+#define COBS_MAX_SIZE(len) ( (len) + (len) / 254 + 1 )
+
+// Stuff len bytes of data into out, escaping every FLAG (0x7E) and
+// ESC (0x7D) byte as ESC followed by the byte XOR 0x20, and XOR every data
+// byte into *bcc. out must have room for 2 * len bytes.
+// Returns the number of bytes written to out.
+int stuffBytes(unsigned char *out, const unsigned char *data, int len, unsigned char *bcc);
+
+// Mask that leaves the fewest FLAG and ESC bytes in data XOR mask, from
+// the byte histogram of data. The mask is sent too, so one that has to be
+// escaped itself counts as well. Stores the bytes stuffBytes() would escape
+// in data as it is in plain and with the mask in masked.
+unsigned char scrambleMask(const unsigned char *data, int len, int *plain, int *masked);
+
+// out = data XOR mask, byte by byte
+void scrambleBytes(unsigned char *out, const unsigned char *data, int len, unsigned char mask);
+
+// Zero-copy stuffing: describe the stuffed form of data as iovecs instead
+// of writing it out. Runs with no FLAG or ESC point into data itself and
+// every byte to escape becomes a constant two-byte sequence, so data must
+// stay unchanged while the iovecs are in use. iov must have room for
+// 2 * len + 1 entries. Returns the number of iovecs written.
+int stuffVector(struct iovec *iov, const unsigned char *data, int len);
+
+// Name of the kernel selected for this CPU ("avx2", "sse2" or "scalar").
+const char *stuffingEngine();
+
+// Average stuffing throughput since the program started, in bytes/s.
+// Returns 0 if nothing was stuffed yet or if built without LINK_PROFILE,
+// which times every call. bench_stuffing measures every engine without
+// the timing overhead.
+double stuffingThroughput();
+
+// Streaming COBS encoder. Every run of up to 254 bytes without a zero is
+// preceded by a code byte giving its length + 1, and a code below 0xFF
+// stands for a zero after the run. The output is XOR-ed with FLAG, so it
+// has no FLAG instead of no zero. The data may be fed in several pieces.
+typedef struct {
+    unsigned char *out;     /* Encoded bytes, COBS_MAX_SIZE() of the data */
+    int size;               /* Bytes written, the open code byte included */
+    int code_at;            /* Where the code of the open run goes */
+    int code;               /* Length of the open run + 1 */
+} cobs_encoder;
+
+// Start encoding into out.
+void cobsEncodeInit(cobs_encoder *e, unsigned char *out);
+
+// Encode len more bytes of data.
+void cobsEncodeUpdate(cobs_encoder *e, const unsigned char *data, int len);
+
+// Close the last run. Returns the size of the encoded data.
+int cobsEncodeFinal(cobs_encoder *e);
+
+// Streaming destuffer for the receive path. Every destuffed byte, the FCS
+// included, goes through the frame check so fcsCheck() on check tells
+// whether the frame is valid as soon as the closing FLAG arrives.
+typedef struct {
+    unsigned char *out;     /* Destination of the destuffed bytes */
+    int capacity;           /* Longest frame accepted, FCS included */
+    int size;               /* Destuffed bytes so far */
+    int escape;             /* Last byte was ESC */
+    int framing;            /* FRAMING_ESCAPE or FRAMING_COBS */
+    int code;               /* COBS code of the current run, 0 before the first */
+    int left;               /* COBS bytes left in the current run */
+    int fcs;                /* FCS type (fcs.h) */
+    unsigned int check;     /* Running frame check state */
+} destuffer;
+
+typedef enum {
+    DESTUFF_MORE,           /* Input used up, frame still open */
+    DESTUFF_FRAME_END,      /* Closing FLAG found */
+    DESTUFF_OVERFLOW        /* Frame longer than capacity, dropped */
+} destuff_status;
+
+// Start decoding a new frame with the given framing into out.
+void destuffInit(destuffer *d, unsigned char *out, int capacity, int fcs, int framing);
+
+// Destuff a chunk of received bytes up to the closing FLAG, updating the
+// checksum on the way. A COBS frame cut short in a run comes out empty. Returns the number of bytes consumed from in (the
+// FLAG included) and stores the outcome in status.
+int destuffBytes(destuffer *d, const unsigned char *in, int len, destuff_status *status);
+
+#endif // _STUFFING_H_
@@ -16,10 +16,8 @@
 #define PCKT_T_FILE_SZ 0x0
 #define PCKT_T_FILE_NM 0x1
 
-#define FRAGMENT_SZ 3000
-#define DATA_PCKT_SZ (FRAGMENT_SZ + 4)
-#define PCKT_L2 (FRAGMENT_SZ / 256)
-#define PCKT_L1 (FRAGMENT_SZ % 256)
+#define DATA_HDR_SZ 4
+#define DATA_PCKT_SZ MAX_PAYLOAD_SIZE
 
 
 
@@ -66,13 +64,19 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
                 //sleep(1);
 
 
-        unsigned char start_pckt[256] = {0};
+        unsigned char start_pckt[MAX_PAYLOAD_SIZE] = {0};
 
         int file_sz = 0;
         unsigned char filename_rcvd[256] = {0};
 
         while (TRUE){
-            if (llread(start_pckt) < 1){
+            int start_sz = llread(start_pckt);
+            // The transmitter disconnected, or the link failed, before the START packet
+            if (start_sz < 0){
+                llclose(TRUE);
+                return;
+            }
+            if (start_sz < 1){
                 continue;
             }
             
@@ -100,12 +104,14 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
         // printf("RCVNG data packet -------\n"); 
         while (TRUE){
         //sleep(1);
-            llread(data_pckt);
+            // The transmitter disconnected without an END packet
+            if (llread(data_pckt) < 0)
+                break;
 
             if ((data_pckt[0] == PCKT_C_DATA)){
                 l2 = data_pckt[2];
                 l1 = data_pckt[3];
-                bytes_read += write(fd_target, &data_pckt[4], l2*256+l1);
+                bytes_read += write(fd_target, &data_pckt[DATA_HDR_SZ], l2*256+l1);
                 // printf("bytes read %d\n", bytes_read);
                 // printf("fd %d\n", fd_target);
             }
@@ -128,8 +134,6 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
         connectionParameters.role = LlTx;
         int fd_data = open(filename, O_RDONLY);
 
-        llopen(connectionParameters);
-
         struct stat st;
         stat(filename, &st);
         int file_sz = st.st_size;
@@ -146,36 +150,38 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
         //printf("file name %s\n", filename);
         memcpy(&ctrl_pckt[9], filename, filename_sz);
 
-        //printf("Sending start packet -------\n"); 
-        if (!llwrite(ctrl_pckt, 5 + sizeof(int) + filename_sz)){
-            return;
-        }
         //sleep(1);
         //for (int i = 0; i< 5 + sizeof(int) + filename_sz; i++)
         //    printf("SRT PCKT = 0x%02X\n", ctrl_pckt[i]);
-        
-        //printf("Start packet sent    -------\n"); 
+
+        // The START packet rides in the SET and the END packet in the DISC
+        // when the receiver takes them there
+        if (llopenWith(connectionParameters, ctrl_pckt, 5 + sizeof(int) + filename_sz) < 0)
+            return;
 
         // DATA PACKETS ASSEMBLY
-        int n_fragments = (file_sz + FRAGMENT_SZ - 1) / FRAGMENT_SZ;
-        // printf("n fragements %d\n", n_fragments);
+        // Fragments follow the payload size the link layer currently asks for
         unsigned char data_pckt[DATA_PCKT_SZ] = {0};
         int n = 0;
-        while (n < n_fragments){
+        while (TRUE){
             printf("n %d\n", n);
-            memset(data_pckt, 0, DATA_PCKT_SZ);
             data_pckt[0] = PCKT_C_DATA;
-            int fragment_sz = read(fd_data, &data_pckt[4], FRAGMENT_SZ);
+            int fragment_sz = read(fd_data, &data_pckt[DATA_HDR_SZ], llpayloadsize() - DATA_HDR_SZ);
             // printf("fragment read : %d\n", fragment_sz);
             data_pckt[1] = n % 100;
             data_pckt[2] = fragment_sz / 256;
             data_pckt[3] = fragment_sz % 256;
 
             n++;
-            if (!fragment_sz)
+            if (fragment_sz <= 0)
                 break;
             // printf("DATA packet start -----\n");
-            llwrite(data_pckt,4+fragment_sz);
+            // The link layer waits out short outages, so a failure is final
+            if (llwrite(data_pckt,DATA_HDR_SZ+fragment_sz) < 0){
+                close(fd_data);
+                llclose(TRUE);
+                return;
+            }
             // printf("DATA packet end -----\n");
             
         }
@@ -191,13 +197,8 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
         ctrl_pckt[8] = filename_sz;
         memcpy(&ctrl_pckt[9], &filename, filename_sz);
         // printf("Sending end packet -------\n"); 
-        if (!llwrite(ctrl_pckt, 5 + sizeof(int) + filename_sz)){
-            return;
-        }
-        // printf("ENd packet sent    -------\n"); 
-
         close(fd_data);
-        llclose(TRUE);
+        llcloseWith(TRUE, ctrl_pckt, 5 + sizeof(int) + filename_sz);
 
     }
 }
\ No newline at end of file
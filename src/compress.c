@@ -0,0 +1,158 @@
+// Payload compression implementation
+
+#include "compress.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+#define RUN_MASK 15     /* Length nibble meaning "more bytes follow" */
+
+// Last position + 1 of every hashed 4 byte sequence, 0 when empty
+static int table[1 << HASH_BITS];
+
+
+static uint32_t read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static int hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// Write the extra bytes of a length of RUN_MASK or more.
+// Returns the new output position, or -1 if out is full.
+static int putLength(unsigned char *out, int o, int capacity, int len) {
+    for (len -= RUN_MASK; len >= 255; len -= 255) {
+        if (o >= capacity)
+            return -1;
+        out[o++] = 255;
+    }
+    if (o >= capacity)
+        return -1;
+    out[o++] = len;
+    return o;
+}
+
+// Read the extra bytes of a length nibble.
+// Returns the new input position, or -1 past the end of the block.
+static int getLength(const unsigned char *in, int i, int len, int *length) {
+    if (*length != RUN_MASK)
+        return i;
+
+    unsigned char b;
+    do {
+        if (i >= len)
+            return -1;
+        b = in[i++];
+        *length += b;
+    } while (b == 255);
+    return i;
+}
+
+// Write one sequence: literals, then a match of match bytes at offset
+// (none if match is 0). Returns the new output position, or -1 if out is full.
+static int putSequence(unsigned char *out, int o, int capacity,
+                       const unsigned char *literals, int lit, int offset, int match) {
+    if (o >= capacity)
+        return -1;
+
+    int token = o++;
+    int ml = match > 0 ? match - MIN_MATCH : 0;
+    out[token] = (lit < RUN_MASK ? lit : RUN_MASK) << 4 | (ml < RUN_MASK ? ml : RUN_MASK);
+
+    if (lit >= RUN_MASK && (o = putLength(out, o, capacity, lit)) < 0)
+        return -1;
+    if (o + lit > capacity)
+        return -1;
+    memcpy(out + o, literals, lit);
+    o += lit;
+
+    if (match == 0)
+        return o;
+
+    if (o + 2 > capacity)
+        return -1;
+    out[o++] = offset & 0xFF;
+    out[o++] = offset >> 8;
+    if (ml >= RUN_MASK && (o = putLength(out, o, capacity, ml)) < 0)
+        return -1;
+
+    return o;
+}
+
+
+int compressBlock(const unsigned char *in, int len, unsigned char *out, int capacity) {
+    int anchor = 0, i = 0, o = 0;
+
+    memset(table, 0, sizeof(table));
+
+    while (i + MIN_MATCH <= len) {
+        uint32_t v = read32(in + i);
+        int h = hash(v);
+        int ref = table[h] - 1;
+        table[h] = i + 1;
+
+        if (ref < 0 || i - ref > MAX_OFFSET || read32(in + ref) != v) {
+            i++;
+            continue;
+        }
+
+        int match = MIN_MATCH;
+        while (i + match < len && in[ref + match] == in[i + match])
+            match++;
+
+        o = putSequence(out, o, capacity, in + anchor, i - anchor, i - ref, match);
+        if (o < 0)
+            return -1;
+        i += match;
+        anchor = i;
+    }
+
+    // The block ends with the literals left, possibly none
+    return putSequence(out, o, capacity, in + anchor, len - anchor, 0, 0);
+}
+
+int decompressBlock(const unsigned char *in, int len, unsigned char *out, int capacity) {
+    int i = 0, o = 0;
+
+    while (i < len) {
+        int token = in[i++];
+        int lit = token >> 4;
+
+        if ((i = getLength(in, i, len, &lit)) < 0 || i + lit > len || o + lit > capacity)
+            return -1;
+        memcpy(out + o, in + i, lit);
+        i += lit;
+        o += lit;
+
+        // The last sequence has no match
+        if (i == len)
+            break;
+
+        if (i + 2 > len)
+            return -1;
+        int offset = in[i] | in[i + 1] << 8;
+        i += 2;
+
+        int match = token & RUN_MASK;
+        if ((i = getLength(in, i, len, &match)) < 0)
+            return -1;
+        match += MIN_MATCH;
+
+        if (offset == 0 || offset > o || o + match > capacity)
+            return -1;
+
+        // Byte by byte: the copy may overlap the bytes it produces
+        const unsigned char *from = out + o - offset;
+        for (int k = 0; k < match; k++)
+            out[o + k] = from[k];
+        o += match;
+    }
+
+    return o;
+}
@@ -0,0 +1,184 @@
+// Frame check sequence implementation
+
+#include "fcs.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+// All CRCs are the reflected (LSB first) variants, which lets one
+// slice-by-8 kernel serve every width. Running a valid frame through the
+// CRC, FCS included, leaves a fixed residue in the register.
+#define CRC16_POLY 0x8408       /* 0x1021 reflected */
+#define CRC16_RESIDUE 0xF0B8
+#define CRC32_POLY 0xEDB88320
+#define CRC32_RESIDUE 0xDEBB20E3
+#define CRC32C_POLY 0x82F63B78
+#define CRC32C_RESIDUE 0xB798B438
+
+// tables[k][b]: contribution of byte b followed by k zero bytes
+typedef uint32_t crc_tables[8][256];
+
+static crc_tables crc16_tables, crc32_tables, crc32c_tables;
+static int tables_ready = 0;
+static int have_sse42 = 0;
+
+
+static void buildTables(crc_tables t, uint32_t poly) {
+    for (int b = 0; b < 256; b++) {
+        uint32_t crc = b;
+        for (int k = 0; k < 8; k++)
+            crc = (crc & 1) ? (crc >> 1) ^ poly : crc >> 1;
+        t[0][b] = crc;
+    }
+
+    for (int k = 1; k < 8; k++)
+        for (int b = 0; b < 256; b++)
+            t[k][b] = (t[k - 1][b] >> 8) ^ t[0][t[k - 1][b] & 0xFF];
+}
+
+static void initTables() {
+    buildTables(crc16_tables, CRC16_POLY);
+    buildTables(crc32_tables, CRC32_POLY);
+    buildTables(crc32c_tables, CRC32C_POLY);
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    have_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+
+    tables_ready = 1;
+}
+
+// Slice-by-8: eight table lookups per 8 input bytes
+static uint32_t crcSlice8(crc_tables t, uint32_t crc, const unsigned char *p, int len) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        w ^= crc;
+
+        crc = t[7][w & 0xFF] ^ t[6][(w >> 8) & 0xFF] ^
+              t[5][(w >> 16) & 0xFF] ^ t[4][(w >> 24) & 0xFF] ^
+              t[3][(w >> 32) & 0xFF] ^ t[2][(w >> 40) & 0xFF] ^
+              t[1][(w >> 48) & 0xFF] ^ t[0][w >> 56];
+    }
+#endif
+
+    for (; len > 0; p++, len--)
+        crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+
+    return crc;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const unsigned char *p, int len) {
+#ifdef __x86_64__
+    uint64_t c = crc;
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c = _mm_crc32_u64(c, w);
+    }
+    crc = (uint32_t) c;
+#endif
+    for (; len > 0; p++, len--)
+        crc = _mm_crc32_u8(crc, *p);
+
+    return crc;
+}
+#endif
+
+// Plain XOR, 16 bytes at a time when possible
+static uint32_t xorUpdate(uint32_t x, const unsigned char *p, int len) {
+    int i = 0;
+
+#ifdef HAVE_X86_KERNELS
+    if (len >= 16) {
+        __m128i acc = _mm_setzero_si128();
+        for (; i + 16 <= len; i += 16)
+            acc = _mm_xor_si128(acc, _mm_loadu_si128((const __m128i *) (p + i)));
+
+        unsigned char lanes[16];
+        _mm_storeu_si128((__m128i *) lanes, acc);
+        for (int k = 0; k < 16; k++)
+            x ^= lanes[k];
+    }
+#endif
+
+    for (; i < len; i++)
+        x ^= p[i];
+    return x;
+}
+
+
+int fcsSize(int type) {
+    switch (type) {
+        case FCS_CRC16: return 2;
+        case FCS_CRC32:
+        case FCS_CRC32C: return 4;
+        default: return 1;
+    }
+}
+
+unsigned int fcsInit(int type) {
+    switch (type) {
+        case FCS_CRC16: return 0xFFFF;
+        case FCS_CRC32:
+        case FCS_CRC32C: return 0xFFFFFFFF;
+        default: return 0;
+    }
+}
+
+unsigned int fcsUpdate(int type, unsigned int state, const unsigned char *data, int len) {
+    if (type == FCS_XOR)
+        return xorUpdate(state, data, len);
+
+    if (!tables_ready)
+        initTables();
+
+    switch (type) {
+        case FCS_CRC16: return crcSlice8(crc16_tables, state, data, len);
+        case FCS_CRC32: return crcSlice8(crc32_tables, state, data, len);
+        case FCS_CRC32C:
+#ifdef HAVE_X86_KERNELS
+            if (have_sse42)
+                return crc32cHardware(state, data, len);
+#endif
+            return crcSlice8(crc32c_tables, state, data, len);
+        default: return state;
+    }
+}
+
+void fcsStore(int type, unsigned int state, unsigned char *out) {
+    // The CRCs are sent complemented, XOR as is
+    unsigned int fcs = type == FCS_XOR ? state : ~state;
+
+    for (int i = 0; i < fcsSize(type); i++)
+        out[i] = (fcs >> (8 * i)) & 0xFF;
+}
+
+int fcsCheck(int type, unsigned int state) {
+    switch (type) {
+        case FCS_CRC16: return state == CRC16_RESIDUE;
+        case FCS_CRC32: return state == CRC32_RESIDUE;
+        case FCS_CRC32C: return state == CRC32C_RESIDUE;
+        default: return (state & 0xFF) == 0;
+    }
+}
+
+const char *fcsEngine(int type) {
+    if (!tables_ready)
+        initTables();
+
+    switch (type) {
+        case FCS_XOR: return "xor";
+        case FCS_CRC32C: return have_sse42 ? "sse4.2" : "slice-by-8";
+        default: return "slice-by-8";
+    }
+}
@@ -0,0 +1,228 @@
+// Forward error correction implementation
+
+#include "fec.h"
+
+#include <string.h>
+
+// GF(256) built on x^8 + x^4 + x^3 + x^2 + 1 with alpha = x. The generator
+// polynomial has the roots alpha^0 .. alpha^31, and codeword byte k of an
+// n byte codeword is the coefficient of x^(n - 1 - k), the parity last.
+#define GF_POLY 0x11D
+
+static unsigned char gf_exp[512];   /* Doubled so exp[log a + log b] needs no modulo */
+static int gf_log[256];
+static unsigned char gen_mul[FEC_PARITY][256]; /* gen_mul[i][b]: b times coefficient i of the generator */
+static int tables_ready = 0;
+
+
+static void initTables() {
+    int x = 1;
+    for (int i = 0; i < 255; i++) {
+        gf_exp[i] = x;
+        gf_log[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= GF_POLY;
+    }
+    for (int i = 255; i < 512; i++)
+        gf_exp[i] = gf_exp[i - 255];
+    gf_log[0] = 0;
+
+    // Generator: product of (x + alpha^i), gen[FEC_PARITY] = 1
+    unsigned char gen[FEC_PARITY + 1] = {1};
+    for (int i = 0; i < FEC_PARITY; i++) {
+        for (int j = i + 1; j > 0; j--)
+            gen[j] = gen[j - 1] ^ (gen[j] ? gf_exp[gf_log[gen[j]] + i] : 0);
+        gen[0] = gen[0] ? gf_exp[gf_log[gen[0]] + i] : 0;
+    }
+
+    for (int i = 0; i < FEC_PARITY; i++)
+        for (int b = 0; b < 256; b++)
+            gen_mul[i][b] = b && gen[i] ? gf_exp[gf_log[b] + gf_log[gen[i]]] : 0;
+
+    tables_ready = 1;
+}
+
+static unsigned char gfMul(unsigned char a, unsigned char b) {
+    return a && b ? gf_exp[gf_log[a] + gf_log[b]] : 0;
+}
+
+static unsigned char gfDiv(unsigned char a, unsigned char b) {
+    return a ? gf_exp[gf_log[a] + 255 - gf_log[b]] : 0;
+}
+
+// alpha^(-e) for 0 <= e < 255
+static unsigned char gfInvPow(int e) {
+    return gf_exp[(255 - e) % 255];
+}
+
+static unsigned char polyEval(const unsigned char *p, int degree, unsigned char x) {
+    unsigned char y = 0;
+    for (int i = degree; i >= 0; i--)
+        y = gfMul(y, x) ^ p[i];
+    return y;
+}
+
+// Correct one codeword of n bytes in place (Berlekamp-Massey, Chien search
+// and Forney). Positions before limit hold data, the rest parity.
+// Returns the number of data bytes corrected or -1 if it cannot be corrected.
+static int decodeCodeword(unsigned char *c, int n, int limit) {
+    unsigned char s[FEC_PARITY];
+    int clean = 1;
+
+    for (int i = 0; i < FEC_PARITY; i++) {
+        unsigned char a = gf_exp[i], y = 0;
+        for (int k = 0; k < n; k++)
+            y = gfMul(y, a) ^ c[k];
+        s[i] = y;
+        clean &= y == 0;
+    }
+    if (clean)
+        return 0;
+
+    // Error locator lambda, lowest degree first
+    unsigned char lambda[FEC_PARITY + 1] = {1}, prev[FEC_PARITY + 1] = {1}, t[FEC_PARITY + 1];
+    int errors = 0, shift = 1;
+    unsigned char last = 1;
+
+    for (int r = 0; r < FEC_PARITY; r++) {
+        unsigned char d = s[r];
+        for (int i = 1; i <= errors; i++)
+            d ^= gfMul(lambda[i], s[r - i]);
+
+        if (d == 0) {
+            shift++;
+            continue;
+        }
+
+        unsigned char scale = gfDiv(d, last);
+        memcpy(t, lambda, sizeof(lambda));
+        for (int i = 0; i + shift <= FEC_PARITY; i++)
+            lambda[i + shift] ^= gfMul(scale, prev[i]);
+
+        if (2 * errors <= r) {
+            errors = r + 1 - errors;
+            memcpy(prev, t, sizeof(prev));
+            last = d;
+            shift = 1;
+        } else
+            shift++;
+    }
+
+    if (errors > FEC_PARITY / 2)
+        return -1;
+
+    // Error evaluator omega = s * lambda mod x^FEC_PARITY
+    unsigned char omega[FEC_PARITY] = {0};
+    for (int i = 0; i < FEC_PARITY; i++)
+        for (int j = 0; j <= errors && j <= i; j++)
+            omega[i] ^= gfMul(s[i - j], lambda[j]);
+
+    int found = 0, corrected = 0;
+    int where[FEC_PARITY / 2];
+    unsigned char value[FEC_PARITY / 2];
+
+    for (int k = 0; k < n && found < errors; k++) {
+        int e = n - 1 - k;
+        unsigned char xinv = gfInvPow(e);
+        if (polyEval(lambda, errors, xinv) != 0)
+            continue;
+
+        // Formal derivative: only the odd terms survive in GF(2^m)
+        unsigned char deriv = 0;
+        for (int i = 1; i <= errors; i += 2)
+            deriv ^= gfMul(lambda[i], gf_exp[(255 - e * (i - 1) % 255) % 255]);
+        if (deriv == 0)
+            return -1;
+
+        where[found] = k;
+        value[found] = gfMul(gf_exp[e], gfDiv(polyEval(omega, FEC_PARITY - 1, xinv), deriv));
+        found++;
+    }
+
+    // Some roots fall outside the (shortened) codeword: too many errors
+    if (found != errors)
+        return -1;
+
+    for (int i = 0; i < found; i++) {
+        c[where[i]] ^= value[i];
+        if (where[i] < limit)
+            corrected++;
+    }
+
+    return corrected;
+}
+
+
+int fecSize(int type, int len) {
+    if (type != FEC_RS || len <= 0)
+        return 0;
+    return FEC_MAX_SIZE(len);
+}
+
+void fecEncodeInit(fec_encoder *e, int len, unsigned char *parity) {
+    if (!tables_ready)
+        initTables();
+
+    e->codewords = (len + FEC_DATA - 1) / FEC_DATA;
+    e->index = 0;
+    e->parity = parity;
+    memset(parity, 0, e->codewords * FEC_PARITY);
+}
+
+void fecEncodeUpdate(fec_encoder *e, const unsigned char *data, int len) {
+    int m = e->codewords;
+
+    for (int i = 0; i < len; i++, e->index++) {
+        // Register r of codeword j lives at parity[r * m + j], which is
+        // also where its parity byte r is sent
+        unsigned char *reg = &e->parity[e->index % m];
+        unsigned char fb = data[i] ^ reg[0];
+
+        for (int r = 0; r < FEC_PARITY - 1; r++)
+            reg[r * m] = reg[(r + 1) * m] ^ gen_mul[FEC_PARITY - 1 - r][fb];
+        reg[(FEC_PARITY - 1) * m] = gen_mul[0][fb];
+    }
+}
+
+int fecDecode(int type, unsigned char *block, int size, int *len) {
+    *len = size;
+    if (type != FEC_RS)
+        return 0;
+
+    // size = len + 32 * ceil(len / 223) has a single solution
+    int m = (size + FEC_DATA + FEC_PARITY - 1) / (FEC_DATA + FEC_PARITY);
+    int data = size - m * FEC_PARITY;
+    if (data <= 0 || (data + FEC_DATA - 1) / FEC_DATA != m) {
+        *len = 0;
+        return -1;
+    }
+    *len = data;
+
+    if (!tables_ready)
+        initTables();
+
+    unsigned char c[FEC_DATA + FEC_PARITY];
+    int corrected = 0;
+
+    for (int j = 0; j < m; j++) {
+        int k = (data - j + m - 1) / m;    /* Data bytes in codeword j */
+
+        for (int i = 0; i < k; i++)
+            c[i] = block[j + i * m];
+        for (int r = 0; r < FEC_PARITY; r++)
+            c[k + r] = block[data + r * m + j];
+
+        int fixed = decodeCodeword(c, k + FEC_PARITY, k);
+        if (fixed < 0)
+            return -1;
+        if (fixed == 0)
+            continue;
+
+        for (int i = 0; i < k; i++)
+            block[j + i * m] = c[i];
+        corrected += fixed;
+    }
+
+    return corrected;
+}
@@ -0,0 +1,255 @@
+// Frame parser implementation
+
+#include "frame_parser.h"
+
+#include <string.h>
+#include <time.h>
+
+#define FLAG 0x7E
+#define ESC 0x7D
+
+// Parser states. The header states are driven by the tables below, the
+// data field states by the destuffer and a FLAG search. P_HUNT has a table
+// row too, but is normally left through memchr(), which glibc vectorizes.
+enum {
+    P_HUNT,     /* Looking for a FLAG */
+    P_FLAG,     /* FLAG seen, address next */
+    P_ADDR,     /* Address accepted, control next */
+    P_SEQ,      /* Two-octet control, sequence octet next */
+    P_NS,       /* Three-octet control, N(S) next */
+    P_NR,       /* Three-octet control, N(R) next */
+    P_BCC1,     /* BCC1 next */
+    P_END,      /* Header without data field, closing FLAG next */
+    P_HEADER,   /* Waiting for parserReceive() or parserSkip() */
+    P_DATA,     /* Destuffing the data field */
+    P_SKIP,     /* Skipping the data field */
+    HEADER_STATES = P_HEADER
+};
+
+// Byte classes, as seen from the current header state. The header octets
+// after the FLAG are stuffed, so a class is taken once ESC is undone.
+enum {
+    K_FLAG,     /* 0x7E */
+    K_OTHER,    /* Not expected here */
+    K_MATCH,    /* Accepted address, sequence octet below the modulo or matching BCC1 */
+    K_SHORT,    /* Single octet control field */
+    K_LONG,     /* Control octet followed by a sequence octet */
+    K_PAIR,     /* Control octet followed by two sequence octets */
+    CLASSES
+};
+
+// What to do on a transition
+enum {
+    ACT_NONE,
+    ACT_DISCARD,    /* Byte thrown away */
+    ACT_ADDR,       /* Keep the address */
+    ACT_CTRL,       /* Keep the control octet */
+    ACT_SEQ,        /* Keep the sequence octet */
+    ACT_NR,         /* Keep the second sequence octet */
+    ACT_BAD_BCC,    /* Header failed BCC1 */
+    ACT_HEADER,     /* Header complete */
+    ACT_DONE        /* Frame without data field complete */
+};
+
+static const unsigned char next_state[HEADER_STATES][CLASSES] = {
+    /*           K_FLAG   K_OTHER  K_MATCH  K_SHORT  K_LONG   K_PAIR */
+    [P_HUNT] = { P_FLAG,  P_HUNT,  P_HUNT,  P_HUNT,  P_HUNT,  P_HUNT },
+    [P_FLAG] = { P_FLAG,  P_HUNT,  P_ADDR,  P_HUNT,  P_HUNT,  P_HUNT },
+    [P_ADDR] = { P_FLAG,  P_HUNT,  P_HUNT,  P_BCC1,  P_SEQ,   P_NS   },
+    [P_SEQ]  = { P_FLAG,  P_HUNT,  P_BCC1,  P_HUNT,  P_HUNT,  P_HUNT },
+    [P_NS]   = { P_FLAG,  P_HUNT,  P_NR,    P_HUNT,  P_HUNT,  P_HUNT },
+    [P_NR]   = { P_FLAG,  P_HUNT,  P_BCC1,  P_HUNT,  P_HUNT,  P_HUNT },
+    [P_BCC1] = { P_FLAG,  P_HUNT,  P_END,   P_HUNT,  P_HUNT,  P_HUNT },
+    [P_END]  = { P_FLAG,  P_HUNT,  P_HUNT,  P_HUNT,  P_HUNT,  P_HUNT },
+};
+
+static const unsigned char action[HEADER_STATES][CLASSES] = {
+    /*           K_FLAG       K_OTHER      K_MATCH      K_SHORT      K_LONG       K_PAIR */
+    [P_HUNT] = { ACT_NONE,    ACT_DISCARD, ACT_DISCARD, ACT_DISCARD, ACT_DISCARD, ACT_DISCARD },
+    [P_FLAG] = { ACT_NONE,    ACT_DISCARD, ACT_ADDR,    ACT_DISCARD, ACT_DISCARD, ACT_DISCARD },
+    [P_ADDR] = { ACT_NONE,    ACT_DISCARD, ACT_DISCARD, ACT_CTRL,    ACT_CTRL,    ACT_CTRL },
+    [P_SEQ]  = { ACT_NONE,    ACT_DISCARD, ACT_SEQ,     ACT_DISCARD, ACT_DISCARD, ACT_DISCARD },
+    [P_NS]   = { ACT_NONE,    ACT_DISCARD, ACT_SEQ,     ACT_DISCARD, ACT_DISCARD, ACT_DISCARD },
+    [P_NR]   = { ACT_NONE,    ACT_DISCARD, ACT_NR,      ACT_DISCARD, ACT_DISCARD, ACT_DISCARD },
+    [P_BCC1] = { ACT_BAD_BCC, ACT_BAD_BCC, ACT_HEADER,  ACT_BAD_BCC, ACT_BAD_BCC, ACT_BAD_BCC },
+    [P_END]  = { ACT_DONE,    ACT_DISCARD, ACT_DISCARD, ACT_DISCARD, ACT_DISCARD, ACT_DISCARD },
+};
+
+
+// Class of a header octet that is not a FLAG
+static int byteClass(const frame_parser *p, unsigned char b) {
+    switch (p->state) {
+        case P_FLAG: return p->address[b] ? K_MATCH : K_OTHER;
+        case P_ADDR:
+            if (p->control[b] & CTRL_CLASS_PAIR)
+                return K_PAIR;
+            if (p->control[b] & CTRL_CLASS_LONG)
+                return K_LONG;
+            return p->control[b] & CTRL_CLASS_SHORT ? K_SHORT : K_OTHER;
+        case P_SEQ:
+        case P_NS:
+        case P_NR: return b < p->modulo ? K_MATCH : K_OTHER;
+        case P_BCC1: return b == p->bcc ? K_MATCH : K_OTHER;
+        default: return K_OTHER;
+    }
+}
+
+static int frameComplete(frame_parser *p, int consumed, parse_status *status) {
+    p->frames++;
+    p->state = P_FLAG;  // The closing FLAG may open the next frame
+    *status = PARSE_FRAME;
+    return consumed;
+}
+
+static int parseBytes(frame_parser *p, const unsigned char *in, int len, parse_status *status) {
+    int i = 0;
+
+    *status = PARSE_MORE;
+
+    while (i < len) {
+        if (p->state == P_DATA) {
+            destuff_status st;
+            i += destuffBytes(&p->data, in + i, len - i, &st);
+
+            if (st == DESTUFF_OVERFLOW) {
+                // Longer than any valid frame: drop it and hunt for the next FLAG
+                p->overflows++;
+                p->resyncs++;
+                p->state = P_HUNT;
+            } else if (st == DESTUFF_FRAME_END) {
+                p->frame.received = 1;
+                p->frame.buffer = p->data.out;
+                p->frame.size = p->data.size;
+                p->frame.check = p->data.check;
+                return frameComplete(p, i, status);
+            }
+            continue;
+        }
+
+        if (p->state == P_HUNT) {
+            // Resynchronise: jump to the next FLAG instead of running every
+            // byte of noise through the tables
+            const unsigned char *flag = memchr(in + i, FLAG, len - i);
+            int end = flag != NULL ? flag - in : len;
+
+            p->discarded += end - i;
+            i = end;
+            if (flag != NULL) {
+                p->state = P_FLAG;
+                i++;
+            }
+            continue;
+        }
+
+        if (p->state == P_SKIP || p->state == P_HEADER) {
+            const unsigned char *end = memchr(in + i, FLAG, len - i);
+            if (end == NULL)
+                return len;
+
+            p->frame.received = 0;
+            return frameComplete(p, end - in + 1, status);
+        }
+
+        unsigned char b = in[i++];
+        int k;
+        if (b == FLAG) {
+            p->escape = 0;
+            k = K_FLAG;
+        } else if (p->escape) {
+            p->escape = 0;
+            b ^= 0x20;
+            k = byteClass(p, b);
+        } else if (b == ESC && p->state != P_END) {
+            p->escape = 1;
+            continue;
+        } else
+            k = byteClass(p, b);
+
+        int act = action[p->state][k];
+        p->state = next_state[p->state][k];
+        if (p->state == P_HUNT)
+            p->resyncs++;
+
+        switch (act) {
+            case ACT_DISCARD:
+                p->discarded++;
+                break;
+            case ACT_ADDR:
+                memset(&p->frame, 0, sizeof(p->frame));
+                p->frame.a = b;
+                break;
+            case ACT_CTRL:
+                p->frame.c = b;
+                p->frame.data = (p->control[b] & CTRL_CLASS_DATA) != 0;
+                p->bcc = p->frame.a ^ b;
+                break;
+            case ACT_SEQ:
+                p->frame.n = b;
+                p->bcc ^= b;
+                break;
+            case ACT_NR:
+                p->frame.nr = b;
+                p->bcc ^= b;
+                break;
+            case ACT_BAD_BCC:
+                p->header_errors++;
+                break;
+            case ACT_HEADER:
+                if (p->frame.data) {
+                    p->state = P_HEADER;
+                    *status = PARSE_HEADER;
+                    return i;
+                }
+                break;
+            case ACT_DONE:
+                return frameComplete(p, i, status);
+            default:
+                break;
+        }
+    }
+
+    return i;
+}
+
+
+void parserInit(frame_parser *p, int modulo, int fcs) {
+    memset(p, 0, sizeof(*p));
+    p->modulo = modulo;
+    p->fcs = fcs;
+    p->state = P_HUNT;
+}
+
+void parserReset(frame_parser *p) {
+    p->state = P_HUNT;
+    p->escape = 0;
+}
+
+int parseFrame(frame_parser *p, const unsigned char *in, int len, parse_status *status) {
+#ifdef LINK_PROFILE
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int consumed = parseBytes(p, in, len, status);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    p->parse_ns += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+    return consumed;
+#else
+    return parseBytes(p, in, len, status);
+#endif
+}
+
+void parserReceive(frame_parser *p, unsigned char *out, int capacity, int framing) {
+    destuffInit(&p->data, out, capacity, p->fcs, framing);
+    p->state = P_DATA;
+}
+
+void parserSkip(frame_parser *p) {
+    p->state = P_SKIP;
+}
+
+double parserThroughput(const frame_parser *p) {
+    if (p->parse_ns == 0)
+        return 0;
+    return p->frames * 1e9 / p->parse_ns;
+}
@@ -2,13 +2,34 @@
 
 #include "link_layer.h"
 #include "serial_port.h"
+#include "stuffing.h"
+#include "fcs.h"
+#include "fec.h"
+#include "frame_parser.h"
+#include "negotiation.h"
+#include "compress.h"
+#include "packet_ring.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
-#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/timerfd.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <errno.h>
+#include <poll.h>
 
 // MISC
 #define _POSIX_SOURCE 1 // POSIX compliant source
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024    /* Linux limit on iovecs per writev */
+#endif
+
 
 #define FLAG 0x7E      /* Synchronisation: start or end of frame */
 #define A_TX 0x03      /* Address field in frames that are commands sent by the Transmitter or replies sent by the Receiver */
@@ -18,9 +39,13 @@
 #define SET 0x03    /* SET frame: sent by the transmitter to initiate a connection */
 #define UA 0x07        /* UA frame: confirmation to the reception of a valid supervision frame */
 #define DISC 0x0B       /* DISC frame: to indicate the termination of a connection */
+#define PROBE 0x0F      /* Keepalive after an outage, answered with an RR carrying N(R) */
 #define INF_0 0x00 // Information frame number 0
 #define INF_1 0x80 // Information frame number 1, could be 0x40
 #define INF_(n) ( (n) == 0 ? INF_0 : INF_1 )
+#define INF_NR 0x40 // Or-ed into the information frame codes: N(R) = 1 piggybacked
+#define I_COMPRESSED 0x20 // Or-ed into every information frame code: the payload is compressed
+#define I_BATCH 0x10 // Or-ed into every information frame code: the payload holds several packets
 #define ESC 0x7D // Byte stuffing escape octet
 #define RR0 0xAA
 #define RR1 0xAB
@@ -29,633 +54,2933 @@
 #define REJ1 0x55
 #define REJ(n) ( (n) == 0 ? REJ0 : REJ1 )
 
-#define NEXT_FRAME(f) ( ((f) + 1) % 2)
+// Extended control field used by the windowed ARQ modes: the first octet
+// gives the frame type and the second one carries N(S) or N(R)
+#define I_EXT 0x40      /* Information frame, N(S) then the piggybacked N(R) */
+#define RR_EXT 0x30     /* Receiver ready, N(R) in the sequence octet */
+#define REJ_EXT 0x31    /* Reject, N(R) in the sequence octet */
+#define SREJ_EXT 0x32   /* Selective reject, resend only frame N(R) */
+
+#define NEXT_FRAME(f) ( ((f) + 1) % cfg.modulo)
+
+// ARQ CONFIGURATION
+#define ARQ_STOP_AND_WAIT 0
+#define ARQ_GO_BACK_N 1
+#define ARQ_SELECTIVE_REPEAT 2
+
+// I-FRAME BATCHING
+#define BATCHING_NONE 0     /* One packet per I-frame */
+#define BATCHING_PREFIX 1   /* llwritev packs packets, each behind its length */
+#define BATCH_PREFIX_SIZE 2 /* Big-endian packet length */
+
+// HANDSHAKE DATA
+#define HANDSHAKE_DATA_NONE 0   /* SET and DISC are bare, every packet rides in an I-frame */
+#define HANDSHAKE_DATA_PACKET 1 /* llopenWith and llcloseWith put a packet in SET and DISC */
+
+// OUTAGE KEEPALIVE
+#define KEEPALIVE_FRAME 0   /* Probe by resending the oldest outstanding I-frame */
+#define KEEPALIVE_PROBE 1   /* Probe with PROBE frames */
+
+#define SEQ_BITS 3              /* Windowed sequence number size offered: 3 (modulo 8) or 7 (modulo 128) */
+#define WINDOW_SIZE 7           /* Transmit window offered, at most 2^SEQ_BITS - 1 (Go-Back-N) or 2^(SEQ_BITS-1) (Selective Repeat) */
+#define MAX_MODULO 128
+#define LEGACY_PAYLOAD_SIZE 1000    /* Longest payload sent to a peer that does not negotiate */
+#define RX_THREAD TRUE          /* Receive and acknowledge on a link thread, llread pops packets from a ring */
+#define RING_SLOTS 16           /* Packets the link thread can pass up before llread takes them */
+#define ASYNC_REQUESTS 64       /* Asynchronous requests accepted until llpoll runs their callbacks */
+#define RESUME_TIME_MS 30000    /* Outage probed for, once retransmissions give up, before llwrite fails; 0: fail at once */
+#define PROBE_MIN_MS 250        /* First interval between outage probes, doubled after each one */
+#define PROBE_MAX_MS 4000       /* Longest interval between outage probes */
+
+// Offered in the SET/UA negotiation. The fastest ARQ mode, FCS,
+// compression, framing, scrambling, batching, handshake data and keepalive both ends support are
+// used. A peer that does not negotiate gets the original protocol, see
+// legacyParams(). Leave FEC_NONE out to insist on FEC.
+#define ARQ_SUPPORTED ( 1 << ARQ_STOP_AND_WAIT | 1 << ARQ_GO_BACK_N | 1 << ARQ_SELECTIVE_REPEAT )
+#define FCS_SUPPORTED ( 1 << FCS_XOR | 1 << FCS_CRC16 | 1 << FCS_CRC32 | 1 << FCS_CRC32C )
+#define FEC_SUPPORTED ( 1 << FEC_NONE | 1 << FEC_RS )
+#define COMPRESSION_SUPPORTED ( 1 << COMPRESSION_NONE | 1 << COMPRESSION_LZ )
+#define FRAMING_SUPPORTED ( 1 << FRAMING_ESCAPE | 1 << FRAMING_COBS )
+#define SCRAMBLING_SUPPORTED ( 1 << SCRAMBLING_NONE | 1 << SCRAMBLING_XOR )
+#define BATCHING_SUPPORTED ( 1 << BATCHING_NONE | 1 << BATCHING_PREFIX )
+#define HANDSHAKE_DATA_SUPPORTED ( 1 << HANDSHAKE_DATA_NONE | 1 << HANDSHAKE_DATA_PACKET )
+#define KEEPALIVE_SUPPORTED ( 1 << KEEPALIVE_FRAME | 1 << KEEPALIVE_PROBE )
+
+typedef struct {
+    int arq;        /* ARQ_STOP_AND_WAIT, ARQ_GO_BACK_N or ARQ_SELECTIVE_REPEAT */
+    int modulo;     /* Size of the sequence space */
+    int window;     /* Maximum number of unacknowledged I-frames */
+    int max_payload;    /* Longest I-frame payload sent */
+    int rx_payload;     /* Longest I-frame payload received, longer frames are dropped */
+    int fcs;            /* Frame check sequence type */
+    int fec;            /* Forward error correction type */
+    int compression;    /* Payload compression method, a frame is only sent compressed if it shrinks */
+    int framing;        /* Data field framing: ESC stuffing or COBS */
+    int scrambling;     /* With ESC stuffing, payloads start with the mask they are XOR-ed with */
+    int batching;       /* llwritev may pack several packets in one I-frame */
+    int handshake_data; /* The first and last packets may ride in SET and DISC */
+    int keepalive;      /* The other end answers PROBE frames */
+    int timeout_ms;     /* Configured timeout, first RTO before any RTT sample */
+    int negotiated;     /* Agreed in the SET/UA exchange, not the original protocol */
+} link_config;
+
+link_config cfg;
+
+// Kinds of frames: numbered ones, then the unnumbered ones used to set up
+// and release the connection
+typedef enum {
+    CTRL_OTHER,
+    CTRL_I,
+    CTRL_RR,
+    CTRL_REJ,
+    CTRL_SREJ,
+    CTRL_SET,
+    CTRL_UA,
+    CTRL_DISC,
+    CTRL_PROBE,
+    CTRL_KINDS
+} ctrl_kind_t;
+
+
+unsigned char frame_expected = 0;  /* Next frame passed up by llread */
+int reject_sent = FALSE;  /* A REJ for rx_next is still pending */
+unsigned char *rx_frame = NULL; /* In-order frame and its FCS, copied to the caller once checked */
+
+// Receive buffer: frames accepted while llread is not waiting (the other
+// end sends while this one writes) and, with Selective Repeat, frames
+// received after a gap wait here until they can be passed up in order
+typedef struct {
+    unsigned char *data;
+    int size;
+    int capacity;
+    int valid;          /* Holds a validated frame not yet passed up */
+    int srej_sent;      /* A SREJ was sent for this sequence number */
+    int batched;        /* Holds several packets, each behind its length */
+    int offset;         /* Next of them passed up */
+} rx_slot;
+
+rx_slot reorder[MAX_MODULO];
+int rx_next = 0;        /* Oldest frame not yet received, N(R) sent in RR */
+int ack_pending = FALSE;    /* rx_next moved since the last RR, REJ or I-frame sent */
+
+frame_parser parser;    /* Parses every received frame, both roles */
+
+// COMMS STATISTICS
+#define LATENCY_BUCKETS 18  /* ACK latency histogram: [0, 1) ms, then [2^(k-1), 2^k) ms, the last one open */
+#define STATS_JSON_ENV "LINK_STATS_JSON"   /* Environment variable naming the JSON statistics file */
+
+typedef struct {
+    unsigned int frames;            /* I-frames acknowledged */
+    unsigned int i_sent;            /* New I-frames sent, retransmissions apart */
+    unsigned int i_received;        /* New I-frames accepted */
+    unsigned int retransmissions;   /* Frames sent again: I-frames and DISC */
+    unsigned int rr_sent;
+    unsigned int rr_received;
+    unsigned int rej_sent;
+    unsigned int rej_received;
+    unsigned int srej_sent;
+    unsigned int srej_received;
+    unsigned int piggybacked_sent;      /* Acknowledgements carried by I-frames instead of a RR */
+    unsigned int piggybacked_received;  /* I-frames whose N(R) acknowledged frames */
+    unsigned int timeouts;
+    unsigned int bcc1_errors;       /* Frame headers failing BCC1 */
+    unsigned int bcc2_errors;       /* I-frames failing the frame check */
+    unsigned int duplicates;        /* I-frames received again */
+    unsigned long long payload_bytes;   /* Payload sent (tx) or accepted (rx) */
+    unsigned long long frame_bytes;     /* Size of the new I-frames on the line */
+    unsigned long long field_bytes;     /* Their data fields before stuffing */
+    unsigned long long stuffed_bytes;   /* Escape bytes added to them by stuffing */
+    unsigned int latency[LATENCY_BUCKETS];  /* From the end of an I-frame to its ACK */
+    long long start_us;             /* Connection established */
+    long long end_us;               /* Connection closed */
+    unsigned int fec_corrected;     /* Data bytes repaired by the FEC */
+    unsigned int fec_saved;         /* Frames repaired by the FEC instead of rejected */
+    unsigned long long gap_us;      /* Line idle time before new I-frames */
+    unsigned long long gap_max_us;
+    unsigned int gaps;
+    unsigned int compressed;        /* I-frames sent or accepted with a compressed payload */
+    unsigned long long carried_bytes;   /* Payload bytes as carried by the I-frames, after compression */
+    unsigned int scrambled;         /* I-frames sent with a non-zero scrambling mask */
+    unsigned long long plain_escapes;   /* Payload bytes plain stuffing would have escaped */
+    unsigned long long masked_escapes;  /* Payload bytes escaped once scrambled, masks included */
+    unsigned int batches;           /* I-frames sent or accepted with several packets */
+    unsigned int batched_packets;   /* Packets they carried */
+    unsigned int handshake_packets; /* Packets sent or received in SET and DISC */
+    unsigned int outages;           /* Times retransmissions gave up and probing started */
+    unsigned int resumes;           /* Outages the other end answered, the session going on */
+    unsigned long long outage_ms;   /* Time spent probing */
+    unsigned int probes;            /* Keepalives sent while probing */
+} comms_stats;
+
+comms_stats stats;
+
+LinkLayer connectionParams;
+
+
+// Asynchronous request: a write waiting for room in the window or for its
+// acknowledgement, or a read waiting for a packet. Once complete, size
+// holds the result passed to the callback.
+typedef struct {
+    LinkLayerCallback done;     /* NULL for llwrite */
+    void *arg;
+    const unsigned char *buf;   /* Payload written */
+    unsigned char *packet;      /* Buffer read into */
+    int size;
+} async_request;
+
+// Transmit window: stuffed frames kept until acknowledged
+typedef struct {
+    unsigned char *frame;   /* Buffer from the frame pool */
+    int size;
+    struct iovec *iov;      /* What writev sends: the whole frame, or header, payload runs and trailer */
+    int iovcnt;
+    long long deadline; /* Selective Repeat retransmission time (ms) */
+    int retries;
+    long long done_us;  /* Estimated time the frame has left the port */
+    int payload;        /* Payload bytes carried by the frame */
+    int retransmitted;  /* Sent more than once, no RTT sample (Karn) */
+    int compressed;     /* The frame carries the payload compressed */
+    int batched;        /* The payload holds several packets */
+    async_request request;  /* Completed once the frame is acknowledged */
+} tx_slot;
+
+tx_slot window[MAX_MODULO];
+int window_base = 0;    /* Oldest unacknowledged frame */
+int frame_to_send = 0;  /* Sequence number of the next new frame */
+
+#define OUTSTANDING() ( (frame_to_send - window_base + cfg.modulo) % cfg.modulo )
+
+// Transmit frame pool, allocated once by llopen: one buffer per window slot
+// and one for the frame encoded ahead. Frames are acknowledged in sequence
+// order, so they take the buffers round-robin.
+// With a window of one, llwrite only returns once its frame is acknowledged
+// and the payload is sent straight from the caller's buffer (zero-copy):
+// the iovecs then describe every payload run, so there are more of them.
+// Only stop-and-wait with ESC framing does so. With a larger window
+// llwrite returns before the acknowledgement and the caller may reuse its
+// buffer, and COBS rewrites every byte, so the negotiated default (a
+// windowed ARQ with COBS) always copies.
+unsigned char *frame_pool = NULL;
+int frame_capacity = 0;     /* Longest stuffed I-frame */
+struct iovec *iov_pool = NULL;
+int iov_per_frame = 0;
+int pool_next = 0;
+
+#define ZERO_COPY() (cfg.window == 1 && cfg.framing == FRAMING_ESCAPE)
+
+long long room_us = 0;  /* When the last acknowledgement made room in the window */
+
+// Compressed payload of the frame being encoded. The frame is stuffed from
+// it right away, except with zero-copy, where llwrite only returns, and
+// the buffer is reused, once the frame is acknowledged.
+unsigned char deflated[MAX_PAYLOAD_SIZE];
+// Decompressed payload of the frame just accepted
+unsigned char inflated[MAX_PAYLOAD_SIZE];
+// Scrambling mask and scrambled payload of the frame being encoded, kept
+// like deflated
+unsigned char scrambled[1 + MAX_PAYLOAD_SIZE];
+
+
+// Monotonic clock in milliseconds
+long long nowMs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Monotonic clock in microseconds
+long long nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+
+// RETRANSMISSION TIMEOUT
+// Jacobson/Karels estimator (RFC 6298): RTO = SRTT + 4 * RTTVAR, doubled on
+// every timeout until a new sample arrives. Samples are taken from the moment
+// a frame has left the port, so the RTO does not depend on the frame size
+// and the serialization time is added per frame.
+#define RTO_MIN_MS 100
+#define RTO_MAX_MS 60000
+
+typedef struct {
+    double srtt;        /* Smoothed round trip time (ms) */
+    double rttvar;      /* Round trip time variation (ms) */
+    int rto;            /* Current retransmission timeout (ms) */
+    int samples;
+} rtt_estimator;
+
+rtt_estimator rtt;
+
+void rttInit(int initial_ms) {
+    rtt.srtt = 0;
+    rtt.rttvar = 0;
+    rtt.rto = initial_ms;
+    rtt.samples = 0;
+}
+
+// RTO from the estimate, without backoff
+void rttUpdate() {
+    double rto = rtt.srtt + (4 * rtt.rttvar > 1 ? 4 * rtt.rttvar : 1);
+    rtt.rto = rto < RTO_MIN_MS ? RTO_MIN_MS : rto > RTO_MAX_MS ? RTO_MAX_MS : (int) rto;
+}
+
+// Add a round trip measured on a frame that was sent only once
+void rttSample(double ms) {
+    if (rtt.samples++ == 0) {
+        rtt.srtt = ms;
+        rtt.rttvar = ms / 2;
+    } else {
+        double err = rtt.srtt - ms;
+        rtt.rttvar = 0.75 * rtt.rttvar + 0.25 * (err < 0 ? -err : err);
+        rtt.srtt = 0.875 * rtt.srtt + 0.125 * ms;
+    }
+
+    rttUpdate();
+}
+
+// Exponential backoff after a timeout
+void rttBackoff() {
+    rtt.rto = 2 * rtt.rto < RTO_MAX_MS ? 2 * rtt.rto : RTO_MAX_MS;
+}
+
+// Drop the backoff once the other end answers again after an outage
+void rttRestore() {
+    if (rtt.samples == 0)
+        rtt.rto = cfg.timeout_ms;
+    else
+        rttUpdate();
+}
+
+// PAYLOAD SIZE
+// Additive increase, multiplicative decrease of the payload size the
+// application is asked to send: every frame acknowledged on its first
+// transmission adds PAYLOAD_STEP bytes and every REJ, SREJ or timeout halves
+// the size of the frame it refers to. With a byte error rate p this settles
+// around sqrt(2 * PAYLOAD_STEP / p) bytes, close to the best goodput.
+#define PAYLOAD_MIN 128
+#define PAYLOAD_INITIAL 1024
+#define PAYLOAD_STEP 64
+
+typedef struct {
+    int size;           /* Payload llwrite should be given now */
+    int smallest;
+    int largest;
+    unsigned int cuts;  /* Number of times the size was reduced */
+} payload_sizer;
+
+payload_sizer payload;
+
+void payloadInit() {
+    payload.size = PAYLOAD_INITIAL < cfg.max_payload ? PAYLOAD_INITIAL : cfg.max_payload;
+    payload.smallest = payload.size;
+    payload.largest = payload.size;
+    payload.cuts = 0;
+}
+
+// A frame was acknowledged without being resent
+void payloadGrow() {
+    payload.size += PAYLOAD_STEP;
+    if (payload.size > cfg.max_payload)
+        payload.size = cfg.max_payload;
+    if (payload.size > payload.largest)
+        payload.largest = payload.size;
+}
+
+// A frame carrying sent bytes was rejected or timed out. Halving from the
+// size of that frame, not the current one, cuts only once for all the frames
+// lost from one window.
+void payloadShrink(int sent) {
+    int size = sent / 2 > PAYLOAD_MIN ? sent / 2 : PAYLOAD_MIN;
+    if (size >= payload.size)
+        return;
+
+    payload.size = size;
+    payload.cuts++;
+    if (size < payload.smallest)
+        payload.smallest = size;
+}
+
+// Estimated time at which the port finishes sending everything written to it
+long long line_free_us = 0;
+
+// Account for size bytes written to the serial port (10 bits per byte)
+void lineSchedule(int size) {
+    long long now = nowUs();
+
+    if (line_free_us < now)
+        line_free_us = now;
+    line_free_us += (long long) size * 10 * 1000000 / connectionParams.baudRate;
+}
+
+// Retransmission timer, a timerfd polled together with the serial port
+int timer_fd = -1;
+int timeoutCount = 0;
+long long outage_start = 0;     /* When outage probing started, 0 while the other end answers */
+long long outage_origin = 0;    /* Start of an outage whose resumes acknowledged nothing yet */
+int probe_ms = PROBE_MIN_MS;    /* Interval to the next probe */
+
+// Arm the timer to expire in ms milliseconds, at once if that is past
+void startTimer(int ms) {
+    struct itimerspec its = {0};
+
+    // A zero it_value would disarm the timer and a negative one is invalid
+    its.it_value.tv_sec = ms > 0 ? ms / 1000 : 0;
+    its.it_value.tv_nsec = ms > 0 ? (ms % 1000) * 1000000L : 1;
+
+    timerfd_settime(timer_fd, 0, &its, NULL);
+}
+
+// Disarm the timer, keeping the timeout count
+void stopTimer() {
+    struct itimerspec its = {0};
+    timerfd_settime(timer_fd, 0, &its, NULL);
+}
+
+// Disarm the timer and reset the timeout count
+void clearTimer() {
+    stopTimer();
+    timeoutCount = 0;
+}
+
+// Timer expiration, reported by the event loop.
+// Returns FALSE if the timer was re-armed since and has not expired.
+int timerExpired() {
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+        return FALSE;
+
+    timeoutCount++;
+    stats.timeouts++;
+    rttBackoff();
+
+    printf("Timeout #%d\n", timeoutCount);
+    return TRUE;
+}
+
+const char *arqName() {
+    switch (cfg.arq) {
+        case ARQ_GO_BACK_N: return "go-back-n";
+        case ARQ_SELECTIVE_REPEAT: return "selective-repeat";
+        default: return "stop-and-wait";
+    }
+}
+
+const char *fcsName() {
+    switch (cfg.fcs) {
+        case FCS_CRC16: return "CRC-16";
+        case FCS_CRC32: return "CRC-32";
+        case FCS_CRC32C: return "CRC-32C";
+        default: return "BCC2";
+    }
+}
+
+// Framing of the data fields, with the stuffing kernel for escapes
+const char *framingName() {
+    return cfg.framing == FRAMING_COBS ? "cobs" : stuffingEngine();
+}
+
+// Histogram bucket of an ACK latency
+int latencyBucket(long long us) {
+    long long ms = us / 1000;
+    int k = 0;
+
+    while (ms > 0 && k < LATENCY_BUCKETS - 1) {
+        ms >>= 1;
+        k++;
+    }
+    return k;
+}
+
+// Lower bound of histogram bucket k in ms
+long long bucketFloor(int k) {
+    return k == 0 ? 0 : 1LL << (k - 1);
+}
+
+// Goodput in bit/s, measured efficiency S = goodput / line rate, and the
+// efficiency stop-and-wait would get on this line, 1 / (1 + 2a) with
+// a = propagation time / frame time. The model needs RTT samples and
+// I-frames sent, so it is only known by the transmitter; otherwise
+// *model is negative.
+void linkEfficiency(double *goodput, double *efficiency, double *model) {
+    double seconds = (stats.end_us - stats.start_us) / 1e6;
+
+    *goodput = seconds > 0 ? stats.payload_bytes * 8 / seconds : 0;
+    *efficiency = *goodput / connectionParams.baudRate;
+    *model = -1;
+
+    if (rtt.samples > 0 && stats.i_sent > 0) {
+        double frame_ms = (double) stats.frame_bytes / stats.i_sent * 10 * 1000 / connectionParams.baudRate;
+        double a = rtt.srtt / 2 / frame_ms;
+        *model = 1 / (1 + 2 * a);
+    }
+}
+
+// Compression ratio of the payloads, and the factor by which it speeds up
+// the transfer: bytes the I-frames would have taken on the line without
+// compression over the bytes they took. Only the transmitter knows the
+// frame sizes, the receiver reports the payload ratio for both.
+void compressionGain(double *ratio, double *gain) {
+    *ratio = stats.carried_bytes > 0 ? (double) stats.payload_bytes / stats.carried_bytes : 1;
+    *gain = *ratio;
+
+    if (stats.frame_bytes > 0)
+        *gain = (double) (stats.frame_bytes + stats.payload_bytes - stats.carried_bytes) / stats.frame_bytes;
+}
+
+void printStatistics() {
+    printf("Number of frames = %d\n", stats.frames);
+    printf("Number of retransmissions = %d\n", stats.retransmissions);
+    printf("I-frames = %u sent, %u received, %u duplicates\n", stats.i_sent, stats.i_received, stats.duplicates);
+    printf("RR = %u sent, %u received; REJ = %u sent, %u received; SREJ = %u sent, %u received\n",
+           stats.rr_sent, stats.rr_received, stats.rej_sent, stats.rej_received, stats.srej_sent, stats.srej_received);
+    if (stats.piggybacked_sent > 0 || stats.piggybacked_received > 0)
+        printf("Piggybacked ACKs = %u sent, %u received\n", stats.piggybacked_sent, stats.piggybacked_received);
+    printf("Errors = %u timeouts, %u BCC1, %u BCC2\n", stats.timeouts, stats.bcc1_errors, stats.bcc2_errors);
+    if (stats.field_bytes > 0)
+        printf("Stuffing overhead = %llu bytes (%.2f%% of %llu)\n", stats.stuffed_bytes,
+               100.0 * stats.stuffed_bytes / stats.field_bytes, stats.field_bytes);
+
+    double goodput, efficiency, model;
+    linkEfficiency(&goodput, &efficiency, &model);
+    printf("Goodput = %.0f bit/s, S = %.3f", goodput, efficiency);
+    if (model >= 0)
+        printf(" (stop-and-wait model %.3f)", model);
+    printf("\n");
+
+    printf("Payload size = %d bytes (%d to %d, reduced %u times)\n", payload.size, payload.smallest, payload.largest, payload.cuts);
+    printf("RTT = %.1f ms (variation %.1f ms, %d samples), RTO = %d ms\n", rtt.srtt, rtt.rttvar, rtt.samples, rtt.rto);
+    for (int k = 0; k < LATENCY_BUCKETS; k++) {
+        if (stats.latency[k] == 0)
+            continue;
+        if (k == LATENCY_BUCKETS - 1)
+            printf("  ACK latency >= %lld ms: %u\n", bucketFloor(k), stats.latency[k]);
+        else
+            printf("  ACK latency %lld-%lld ms: %u\n", bucketFloor(k), bucketFloor(k + 1), stats.latency[k]);
+    }
+    unsigned long read_calls, read_filled, read_bytes;
+    serialReadStats(&read_calls, &read_filled, &read_bytes);
+    printf("Serial reads = %lu calls, %lu with data, %lu bytes (%.1f bytes per read with data)\n",
+           read_calls, read_filled, read_bytes, read_filled ? (double) read_bytes / read_filled : 0.0);
+    if (cfg.scrambling != SCRAMBLING_NONE && stats.field_bytes > 0)
+        printf("Scrambling = %u of %u frames masked, %llu -> %llu bytes to escape (stuffing overhead %.2f%% -> %.2f%%)\n",
+               stats.scrambled, stats.i_sent, stats.plain_escapes, stats.masked_escapes,
+               100.0 * stats.plain_escapes / stats.field_bytes, 100.0 * stats.masked_escapes / stats.field_bytes);
+    if (stuffingThroughput() > 0)
+        printf("Stuffing throughput (%s) = %.0f bytes/s\n", framingName(), stuffingThroughput());
+    printf("Link = %s, window %d, modulo %d, payload up to %d bytes (%s)\n", arqName(), cfg.window, cfg.modulo,
+           cfg.max_payload, cfg.negotiated ? "negotiated" : "original");
+    printf("Frame check = %s (%s)\n", fcsName(), fcsEngine(cfg.fcs));
+    // Throughputs are only measured with LINK_PROFILE
+    if (parserThroughput(&parser) > 0)
+        printf("Parser = %lu frames, %.0f frames/s\n", parser.frames, parserThroughput(&parser));
+    else
+        printf("Parser = %lu frames\n", parser.frames);
+    if (parser.resyncs > 0) {
+        // Time the discarded bytes took on the line, 10 bits each
+        double bytes = (double) parser.discarded / parser.resyncs;
+        printf("Resynchronisation = %lu times, %llu bytes discarded (%.1f bytes, %.2f ms average)\n",
+               parser.resyncs, parser.discarded, bytes, bytes * 10 * 1000 / connectionParams.baudRate);
+    }
+    if (stats.gaps > 0)
+        printf("Inter-frame gap = %.1f us average, %llu us max (%u frames)\n", (double) stats.gap_us / stats.gaps, stats.gap_max_us, stats.gaps);
+    if (cfg.fec == FEC_RS)
+        printf("FEC = RS(255,223), %u bytes corrected, %u retransmissions avoided\n", stats.fec_corrected, stats.fec_saved);
+    if (cfg.compression != COMPRESSION_NONE) {
+        double ratio, gain;
+        compressionGain(&ratio, &gain);
+        printf("Compression = %u of %u frames, %llu -> %llu payload bytes (ratio %.2f, throughput x%.2f)\n",
+               stats.compressed, stats.i_sent + stats.i_received, stats.payload_bytes, stats.carried_bytes, ratio, gain);
+    }
+    if (stats.batches > 0)
+        printf("Batching = %u packets in %u frames (%.1f per frame)\n",
+               stats.batched_packets, stats.batches, (double) stats.batched_packets / stats.batches);
+    if (stats.handshake_packets > 0)
+        printf("Handshake data = %u packets in SET and DISC\n", stats.handshake_packets);
+    if (stats.outages > 0)
+        printf("Outages = %u, %u resumed after %llu ms and %u probes\n",
+               stats.outages, stats.resumes, stats.outage_ms, stats.probes);
+}
+
+// Write every statistic to path as one JSON object.
+// Returns -1 if the file cannot be written.
+int writeStatisticsJson(const char *path) {
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    double goodput, efficiency, model;
+    linkEfficiency(&goodput, &efficiency, &model);
+    unsigned long read_calls, read_filled, read_bytes;
+    serialReadStats(&read_calls, &read_filled, &read_bytes);
+
+    fprintf(f, "{\n");
+    fprintf(f, "  \"role\": \"%s\",\n", connectionParams.role == LlTx ? "tx" : "rx");
+    fprintf(f, "  \"arq\": \"%s\", \"modulo\": %d, \"window\": %d, \"max_payload\": %d, \"negotiated\": %s,\n",
+            arqName(), cfg.modulo, cfg.window, cfg.max_payload, cfg.negotiated ? "true" : "false");
+    fprintf(f, "  \"fcs\": \"%s\", \"fec\": \"%s\", \"baud_rate\": %d,\n", fcsName(), cfg.fec == FEC_RS ? "RS(255,223)" : "none", connectionParams.baudRate);
+    fprintf(f, "  \"elapsed_s\": %.3f,\n", (stats.end_us - stats.start_us) / 1e6);
+    fprintf(f, "  \"frames\": {\"acknowledged\": %u, \"i_sent\": %u, \"i_received\": %u, \"retransmissions\": %u, \"duplicates\": %u},\n",
+            stats.frames, stats.i_sent, stats.i_received, stats.retransmissions, stats.duplicates);
+    fprintf(f, "  \"supervision\": {\"rr_sent\": %u, \"rr_received\": %u, \"rej_sent\": %u, \"rej_received\": %u, \"srej_sent\": %u, \"srej_received\": %u, "
+            "\"piggybacked_sent\": %u, \"piggybacked_received\": %u},\n",
+            stats.rr_sent, stats.rr_received, stats.rej_sent, stats.rej_received, stats.srej_sent, stats.srej_received,
+            stats.piggybacked_sent, stats.piggybacked_received);
+    fprintf(f, "  \"errors\": {\"timeouts\": %u, \"bcc1\": %u, \"bcc2\": %u},\n", stats.timeouts, stats.bcc1_errors, stats.bcc2_errors);
+    fprintf(f, "  \"bytes\": {\"payload\": %llu, \"frames\": %llu, \"data_fields\": %llu, \"stuffing_overhead\": %llu},\n",
+            stats.payload_bytes, stats.frame_bytes, stats.field_bytes, stats.stuffed_bytes);
+    fprintf(f, "  \"goodput_bps\": %.0f, \"efficiency\": %.4f, ", goodput, efficiency);
+    if (model >= 0)
+        fprintf(f, "\"efficiency_stop_and_wait\": %.4f,\n", model);
+    else
+        fprintf(f, "\"efficiency_stop_and_wait\": null,\n");
+    fprintf(f, "  \"rtt_ms\": {\"srtt\": %.2f, \"rttvar\": %.2f, \"rto\": %d, \"samples\": %d},\n", rtt.srtt, rtt.rttvar, rtt.rto, rtt.samples);
+
+    fprintf(f, "  \"ack_latency_ms\": [");
+    for (int k = 0; k < LATENCY_BUCKETS; k++) {
+        fprintf(f, "%s{\"from\": %lld, ", k ? ", " : "", bucketFloor(k));
+        if (k == LATENCY_BUCKETS - 1)
+            fprintf(f, "\"to\": null, ");
+        else
+            fprintf(f, "\"to\": %lld, ", bucketFloor(k + 1));
+        fprintf(f, "\"count\": %u}", stats.latency[k]);
+    }
+    fprintf(f, "],\n");
+
+    fprintf(f, "  \"payload_size\": {\"current\": %d, \"smallest\": %d, \"largest\": %d, \"reductions\": %u},\n",
+            payload.size, payload.smallest, payload.largest, payload.cuts);
+    fprintf(f, "  \"inter_frame_gap_us\": {\"average\": %.1f, \"max\": %llu, \"frames\": %u},\n",
+            stats.gaps ? (double) stats.gap_us / stats.gaps : 0.0, stats.gap_max_us, stats.gaps);
+    fprintf(f, "  \"fec\": {\"bytes_corrected\": %u, \"retransmissions_avoided\": %u},\n", stats.fec_corrected, stats.fec_saved);
+    double ratio, gain;
+    compressionGain(&ratio, &gain);
+    fprintf(f, "  \"compression\": {\"method\": \"%s\", \"frames\": %u, \"carried_bytes\": %llu, \"ratio\": %.3f, \"throughput_gain\": %.3f},\n",
+            cfg.compression == COMPRESSION_LZ ? "lz" : "none", stats.compressed, stats.carried_bytes, ratio, gain);
+    fprintf(f, "  \"serial_reads\": {\"calls\": %lu, \"with_data\": %lu, \"bytes\": %lu},\n", read_calls, read_filled, read_bytes);
+    fprintf(f, "  \"stuffing\": {\"engine\": \"%s\", \"bytes_per_s\": %.0f},\n", framingName(), stuffingThroughput());
+    fprintf(f, "  \"scrambling\": {\"enabled\": %s, \"frames_masked\": %u, \"plain_escapes\": %llu, \"masked_escapes\": %llu},\n",
+            cfg.scrambling != SCRAMBLING_NONE ? "true" : "false", stats.scrambled, stats.plain_escapes, stats.masked_escapes);
+    fprintf(f, "  \"batching\": {\"enabled\": %s, \"frames\": %u, \"packets\": %u},\n",
+            cfg.batching != BATCHING_NONE ? "true" : "false", stats.batches, stats.batched_packets);
+    fprintf(f, "  \"handshake_data\": {\"enabled\": %s, \"packets\": %u},\n",
+            cfg.handshake_data != HANDSHAKE_DATA_NONE ? "true" : "false", stats.handshake_packets);
+    fprintf(f, "  \"outages\": {\"keepalive\": \"%s\", \"count\": %u, \"resumed\": %u, \"duration_ms\": %llu, \"probes\": %u},\n",
+            cfg.keepalive == KEEPALIVE_PROBE ? "probe" : "frame", stats.outages, stats.resumes, stats.outage_ms, stats.probes);
+    fprintf(f, "  \"parser\": {\"frames\": %lu, \"frames_per_s\": %.0f, \"overflows\": %lu, \"resyncs\": %lu, \"discarded_bytes\": %llu}\n",
+            parser.frames, parserThroughput(&parser), parser.overflows, parser.resyncs, parser.discarded);
+    fprintf(f, "}\n");
+
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+
+#define HEADER_MAX_SIZE ( 1 + 2 * 5 )  /* FLAG, then A C [N(S) [N(R)]] BCC1 all escaped */
+
+// Frame header: FLAG, the address, the ctrl_size control octets and BCC1.
+// Everything after the FLAG is stuffed like a data field, since N(S), N(R)
+// and BCC1 may take any value, FLAG and ESC included. The 1-octet codes
+// never need an escape, so old peers see the original header.
+// Returns its size, at most HEADER_MAX_SIZE.
+int buildHeader(unsigned char *out, unsigned char a, const unsigned char *ctrl, int ctrl_size) {
+    unsigned char header[5];
+    unsigned char bcc1 = a;
+
+    header[0] = a;
+    for (int i = 0; i < ctrl_size; i++) {
+        header[1 + i] = ctrl[i];
+        bcc1 ^= ctrl[i];
+    }
+    header[1 + ctrl_size] = bcc1;
+
+    unsigned char bcc = 0;
+    out[0] = FLAG;
+    return 1 + stuffBytes(out + 1, header, 2 + ctrl_size, &bcc);
+}
+
+int sendSupervision(unsigned char a, unsigned char c) {
+    // Create frame to send
+    unsigned char frame[HEADER_MAX_SIZE + 1];
+    int size = buildHeader(frame, a, &c, 1);
+
+    frame[size++] = FLAG;
+
+    // Write the frame until all bytes are written
+    while (writeBytes((const char *) frame, size) != size);
+
+    return 0;
+}
+
+#define HANDSHAKE_MAX_SIZE ( HEADER_MAX_SIZE + 2 * NEGOTIATION_MAX_SIZE + 1 )
+
+// SET, UA or DISC carrying the parameter block of p and the packet in
+// data in its data field, or a bare one if both are NULL. out needs
+// HANDSHAKE_MAX_SIZE bytes. Returns the frame size.
+int handshakeFrame(unsigned char *out, unsigned char a, unsigned char c, const link_params *p,
+                   const unsigned char *data, int dataSize) {
+    int size = buildHeader(out, a, &c, 1);
+
+    if (p != NULL || data != NULL) {
+        unsigned char block[NEGOTIATION_MAX_SIZE];
+        unsigned char bcc = 0;
+        size += stuffBytes(&out[size], block, paramsEncode(p, data, dataSize, block), &bcc);
+    }
+    out[size++] = FLAG;
+
+    return size;
+}
+
+// Write size bytes, looping over partial writes.
+// Returns -1 on error.
+int writeAll(const unsigned char *bytes, int size) {
+    int written = 0;
+
+    while (written < size) {
+        int res = writeBytes((const char *) bytes + written, size - written);
+        if (res < 0)
+            return -1;
+        written += res;
+    }
+
+    return 0;
+}
+
+int sendFrame(const unsigned char *frame, int size) {
+    if (writeAll(frame, size) < 0)
+        return -1;
+    lineSchedule(size);
+
+    return 0;
+}
+
+// Send a frame described by iovecs with as few writev calls as possible.
+// The iovecs are left untouched so the frame can be sent again.
+int sendFrameVector(const struct iovec *iov, int iovcnt) {
+    int size = 0;
+
+    while (iovcnt > 0) {
+        int res = writeVector(iov, iovcnt < IOV_MAX ? iovcnt : IOV_MAX);
+        if (res < 0)
+            return -1;
+        size += res;
+
+        while (iovcnt > 0 && res >= (int) iov->iov_len) {
+            res -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (res > 0) {
+            // Finish the iovec that was cut short
+            if (writeAll((const unsigned char *) iov->iov_base + res, iov->iov_len - res) < 0)
+                return -1;
+            size += iov->iov_len - res;
+            iov++;
+            iovcnt--;
+        }
+    }
+    lineSchedule(size);
+
+    return 0;
+}
+
+// Writes the control field of a numbered frame into ctrl (3 octets).
+// Stop-and-wait keeps the original 1-bit codes, the windowed modes use the
+// extended control field. I-frames also carry nr, the N(R) acknowledging
+// the frames received from the other end. Returns the number of control octets.
+int encodeControl(unsigned char *ctrl, ctrl_kind_t kind, int n, int nr) {
+    if (cfg.arq == ARQ_STOP_AND_WAIT) {
+        switch (kind) {
+            case CTRL_I: ctrl[0] = INF_(n) | (nr ? INF_NR : 0); break;
+            case CTRL_RR: ctrl[0] = RR(n); break;
+            case CTRL_REJ: ctrl[0] = REJ(n); break;
+            default: return 0;
+        }
+        return 1;
+    }
+
+    switch (kind) {
+        case CTRL_I: ctrl[0] = I_EXT; break;
+        case CTRL_RR: ctrl[0] = RR_EXT; break;
+        case CTRL_REJ: ctrl[0] = REJ_EXT; break;
+        case CTRL_SREJ: ctrl[0] = SREJ_EXT; break;
+        default: return 0;
+    }
+    ctrl[1] = n;
+    if (kind != CTRL_I)
+        return 2;
+    ctrl[2] = nr;
+    return 3;
+}
+
+// Classifies the first control octet of a frame.
+// For the 1-bit codes the sequence number is stored in n, for the extended
+// ones extended is set and the number follows in the next octet (then
+// N(R) for I-frames).
+ctrl_kind_t decodeControl(unsigned char c, int *n, int *extended) {
+    *extended = FALSE;
+    *n = 0;
+
+    switch (c) {
+        case SET: return CTRL_SET;
+        case UA: return CTRL_UA;
+        case DISC: return CTRL_DISC;
+        case PROBE: return CTRL_PROBE;
+        default: break;
+    }
+
+    if (cfg.arq == ARQ_STOP_AND_WAIT) {
+        // Any combination of N(S), N(R), the compression and batch bits
+        if ((c & ~(INF_1 | INF_NR | I_COMPRESSED | I_BATCH)) == 0) {
+            *n = (c & INF_1) != 0;
+            return CTRL_I;
+        }
+
+        switch (c) {
+            case RR0: *n = 0; return CTRL_RR;
+            case RR1: *n = 1; return CTRL_RR;
+            case REJ0: *n = 0; return CTRL_REJ;
+            case REJ1: *n = 1; return CTRL_REJ;
+            default: return CTRL_OTHER;
+        }
+    }
+
+    *extended = TRUE;
+    if ((c & ~(I_COMPRESSED | I_BATCH)) == I_EXT)
+        return CTRL_I;
+
+    switch (c) {
+        case RR_EXT: return CTRL_RR;
+        case REJ_EXT: return CTRL_REJ;
+        case SREJ_EXT: return CTRL_SREJ;
+        default: return CTRL_OTHER;
+    }
+}
+
+// Address of the I-frames this end sends, and of the RR/REJ/SREJ it gets
+// back for them. The other end's I-frames and their acknowledgements use
+// remoteAddress().
+unsigned char localAddress() {
+    return connectionParams.role == LlTx ? A_TX : A_RX;
+}
+
+unsigned char remoteAddress() {
+    return connectionParams.role == LlTx ? A_RX : A_TX;
+}
+
+// Send a RR, REJ or SREJ supervision frame carrying N(R) = n
+int sendAck(ctrl_kind_t kind, int n) {
+    unsigned char frame[HEADER_MAX_SIZE + 1];
+    unsigned char ctrl[3] = {0};
+
+    int size = buildHeader(frame, remoteAddress(), ctrl, encodeControl(ctrl, kind, n, 0));
+    frame[size++] = FLAG;
+
+    switch (kind) {
+        case CTRL_RR: stats.rr_sent++; break;
+        case CTRL_REJ: stats.rej_sent++; break;
+        case CTRL_SREJ: stats.srej_sent++; break;
+        default: break;
+    }
+    // RR and REJ carry rx_next, which answers any pending acknowledgement
+    if (kind != CTRL_SREJ)
+        ack_pending = FALSE;
+
+    return sendFrame(frame, size);
+}
+
+////////////////////////////////////////////////
+// LLOPEN
+////////////////////////////////////////////////
+// Size of the data field of an I-frame carrying payload bytes, before
+// stuffing: payload, FCS and FEC parity
+int dataFieldSize(int payload) {
+    int size = payload + fcsSize(cfg.fcs);
+    return size + fecSize(cfg.fec, size);
+}
+
+// Longest payload an I-frame carries either way: the packet, after its
+// scrambling mask
+int longestPayload() {
+    int longest = cfg.rx_payload > cfg.max_payload ? cfg.rx_payload : cfg.max_payload;
+    return longest + (cfg.scrambling != SCRAMBLING_NONE);
+}
+
+// Allocate the transmit frame pool for the negotiated configuration
+int allocateFramePool() {
+    frame_capacity = HEADER_MAX_SIZE + 2 * dataFieldSize(longestPayload()) + 1;
+    iov_per_frame = ZERO_COPY() ? 2 * longestPayload() + 3 : 1;
+
+    frame_pool = malloc((size_t) (cfg.window + 1) * frame_capacity);
+    iov_pool = malloc((size_t) (cfg.window + 1) * iov_per_frame * sizeof(struct iovec));
+    if (frame_pool == NULL || iov_pool == NULL) {
+        free(frame_pool);
+        free(iov_pool);
+        frame_pool = NULL;
+        iov_pool = NULL;
+        return -1;
+    }
+    pool_next = 0;
+
+    return 0;
+}
+
+////////////////////////////////////////////////
+// ASYNCHRONOUS REQUESTS
+////////////////////////////////////////////////
+// llwriteAsync and llreadAsync queue requests the link thread serves.
+// Completed ones wait for llpoll, which runs their callbacks outside
+// link_lock, so a callback may queue the next request. Without RX_THREAD
+// they block like llwrite and llread, only the callback is deferred.
+typedef struct {
+    async_request items[ASYNC_REQUESTS];
+    int head;
+    int count;
+} request_queue;
+
+request_queue write_queue;      /* Writes waiting for room in the window */
+request_queue read_queue;       /* Reads waiting for a packet */
+request_queue completions;      /* Requests whose callback has not run yet */
+int async_pending = 0;          /* Requests accepted and not yet passed to their callback */
+int link_event = -1;            /* eventfd signalled when packets are pushed, requests complete or the link ends */
+
+// Returns -1 if the queue is full
+int queuePush(request_queue *q, const async_request *r) {
+    if (q->count == ASYNC_REQUESTS)
+        return -1;
+    q->items[(q->head + q->count) % ASYNC_REQUESTS] = *r;
+    q->count++;
+    return 0;
+}
+
+// Returns -1 if the queue is empty
+int queuePop(request_queue *q, async_request *r) {
+    if (q->count == 0)
+        return -1;
+    *r = q->items[q->head];
+    q->head = (q->head + 1) % ASYNC_REQUESTS;
+    q->count--;
+    return 0;
+}
+
+// Wake up llpoll or llread
+void signalLink() {
+    uint64_t one = 1;
+    if (link_event >= 0 && write(link_event, &one, sizeof(one)) < 0)
+        perror("write");
+}
+
+// Hand a request to llpoll with its result, link_lock held. Never full:
+// every pending request has room in every queue.
+void completeRequest(async_request *r, int result) {
+    r->size = result;
+    queuePush(&completions, r);
+    signalLink();
+}
+
+////////////////////////////////////////////////
+// FRAME RECEPTION
+////////////////////////////////////////////////
+// Every frame goes through one parser, which hands complete frames to the
+// handlers of the current wait by address and control kind
+unsigned char *rx_packet = NULL;    /* Caller's packet while llread waits, NULL otherwise */
+int rx_size = 0;                    /* Size of the packet llread delivered */
+int disc_received = FALSE;          /* The other end disconnected during a transfer */
+unsigned char handshake_block[NEGOTIATION_MAX_SIZE];   /* Parameter block of the last SET, UA or DISC */
+
+// Packets the other end put in its SET and DISC, passed up before and
+// after those of its I-frames
+unsigned char open_packet[NEG_DATA_MAX];
+int open_packet_size = -1;      /* -1 once passed up, or if there was none */
+unsigned char close_packet[NEG_DATA_MAX];
+int close_packet_size = -1;
+
+// With RX_THREAD, once connected, a link thread runs every receive wait
+// and handler. It holds link_lock except while it sleeps, so llwrite and
+// llclose take the lock to use the link state and sleep on link_cond.
+// Packets go up to llread through a lock-free ring.
+pthread_mutex_t link_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t link_cond = PTHREAD_COND_INITIALIZER;  /* The link thread handled some frames */
+pthread_t link_thread;
+int thread_running = FALSE;     /* Frames are received by the link thread */
+int thread_stop = FALSE;        /* llclose asked the link thread to return */
+int link_failed = FALSE;        /* Retransmissions and outage probes gave up */
+packet_ring rx_ring;            /* Packets accepted in order, popped by llread */
+int ring_reader = FALSE;        /* llread is popping the ring, so llreadAsync is refused */
+
+int startLinkThread();  /* With the link thread, after llwrite */
+
+// Handler of one kind of frame. n is the sequence number it carries.
+// Returns -1 on error, otherwise a combination of the FRAME_* events below;
+// each wait stops on the events it is interested in.
+typedef int (*frame_handler)(const frame_info *f, ctrl_kind_t kind, int n);
+
+#define FRAME_ACKED 1       /* Some of our I-frames were acknowledged */
+#define FRAME_DELIVERED 2   /* A packet was passed to llread */
+#define FRAME_EXPECTED 4    /* The supervision frame waited for */
+#define FRAME_DISC 8        /* The other end disconnects */
+#define FRAME_STORED 16     /* In-order packets wait in the receive buffer */
+
+// Handler tables are indexed by whose I-frames and commands a frame
+// belongs to: this end's (localAddress()) or the other end's
+#define LOCAL 0
+#define REMOTE 1
+
+#define ADDRESS_INDEX(a) ( (a) == localAddress() ? LOCAL : REMOTE )
+
+// Accept the address and control octets of the current configuration.
+// SET, UA and DISC may carry a parameter block, so they may have a data field.
+void parserSetup() {
+    parser.modulo = cfg.modulo;
+    parser.fcs = cfg.fcs;
+    memset(parser.address, 0, sizeof(parser.address));
+    memset(parser.control, 0, sizeof(parser.control));
+    parser.address[A_TX] = 1;
+    parser.address[A_RX] = 1;
+
+    for (int c = 0; c < 256; c++) {
+        int n, extended;
+        ctrl_kind_t kind = decodeControl(c, &n, &extended);
+        if (kind == CTRL_OTHER)
+            continue;
+
+        if (kind == CTRL_I)
+            parser.control[c] = (extended ? CTRL_CLASS_PAIR : CTRL_CLASS_SHORT) | CTRL_CLASS_DATA;
+        else if (kind == CTRL_SET || kind == CTRL_UA || kind == CTRL_DISC)
+            parser.control[c] = CTRL_CLASS_SHORT | CTRL_CLASS_DATA;
+        else
+            parser.control[c] = extended ? CTRL_CLASS_LONG : CTRL_CLASS_SHORT;
+    }
+}
+
+// Receive buffer slot for frame ns, so it never lands in the caller's
+// packet. Returns NULL if it cannot be allocated.
+unsigned char *reorderBuffer(int ns) {
+    rx_slot *slot = &reorder[ns];
+    int size = dataFieldSize(longestPayload());
+
+    if (slot->capacity < size) {
+        unsigned char *data = realloc(slot->data, size);
+        if (data == NULL)
+            return NULL;
+        slot->data = data;
+        slot->capacity = size;
+    }
+
+    return slot->data;
+}
+
+// Buffer the in-order frame is destuffed into, sized for the longest
+// payload plus its FCS and parity. Returns NULL if it cannot be allocated.
+unsigned char *receiveBuffer() {
+    if (rx_frame == NULL)
+        rx_frame = malloc(dataFieldSize(longestPayload()));
+
+    return rx_frame;
+}
+
+// Frames accepted but not passed up by llread yet
+int backlog() {
+    return (rx_next - frame_expected + cfg.modulo) % cfg.modulo;
+}
+
+// Buffer the data field of I-frame ns is destuffed into, or NULL to skip
+// it: duplicates, frames after a gap (Go-Back-N) and frames that do not
+// fit until llread passes the earlier ones up. A frame llread can take
+// right away skips the receive buffer, unless it is a batch llread takes
+// packet by packet. c is its control octet.
+unsigned char *iFrameBuffer(int ns, unsigned char c) {
+    int ahead = (ns - rx_next + cfg.modulo) % cfg.modulo;
+
+    if (ahead >= cfg.window || reorder[ns].valid)
+        return NULL;
+    if (cfg.arq != ARQ_SELECTIVE_REPEAT && ahead != 0)
+        return NULL;
+    if (backlog() + ahead >= cfg.window)
+        return NULL;
+
+    if (ahead == 0 && backlog() == 0 && rx_packet != NULL && !(c & I_BATCH))
+        return receiveBuffer();
+    return reorderBuffer(ns);
+}
+
+// Sequence number carried by a frame
+int frameNumber(const frame_info *f, ctrl_kind_t *kind) {
+    int n, extended;
+
+    *kind = decodeControl(f->c, &n, &extended);
+    return extended ? f->n : n;
+}
+
+// N(R) piggybacked on an I-frame
+int frameAck(const frame_info *f) {
+    if (cfg.arq == ARQ_STOP_AND_WAIT)
+        return (f->c & INF_NR) != 0;
+    return f->nr;
+}
+
+// Get the next complete frame, sleeping until the serial port has data or
+// the timer expires.
+// Returns 1 if a frame was stored in f, 0 if the timer expired, -1 on error.
+int receiveFrame(frame_info *f) {
+    while (TRUE) {
+        // Acknowledge before sleeping. Frames already buffered are parsed
+        // first, so one RR covers them all, and an I-frame sent meanwhile
+        // carries it for free.
+        if (ack_pending && bufferedBytes() == 0)
+            sendAck(CTRL_RR, rx_next);
+
+        // The link thread lets llwrite in while it sleeps. llclose stops
+        // it by firing the timer, which is then no timeout.
+        if (thread_stop)
+            return 0;
+        if (thread_running)
+            pthread_mutex_unlock(&link_lock);
+        int ready = waitReadable(timer_fd, -1);
+        if (thread_running)
+            pthread_mutex_lock(&link_lock);
+
+        if (ready < 0)
+            return -1;
+        // Checked even with bytes waiting, so noise or frames we drop
+        // cannot hold off a retransmission
+        if ((ready & EVENT_READABLE) && (thread_stop || timerExpired()))
+            return 0;
+        if (!(ready & PORT_READABLE))
+            continue;
+
+        const unsigned char *span;
+        int n = readBuffered(&span);
+        if (n < 0)
+            return -1;
+
+        parse_status status;
+        consumeBuffered(parseFrame(&parser, span, n, &status));
+
+        if (status == PARSE_HEADER) {
+            ctrl_kind_t kind;
+            unsigned char *data = NULL;
+            int capacity = dataFieldSize(longestPayload());
+
+            // Only the other end's I-frames, SET, UA and DISC carry data for us
+            if (parser.frame.a == remoteAddress()) {
+                int n = frameNumber(&parser.frame, &kind);
+                if (kind == CTRL_I)
+                    data = iFrameBuffer(n, parser.frame.c);
+                else {
+                    data = handshake_block;
+                    capacity = NEGOTIATION_MAX_SIZE;
+                }
+            }
+
+            if (data != NULL)
+                parserReceive(&parser, data, capacity, kind == CTRL_I ? cfg.framing : FRAMING_ESCAPE);
+            else
+                parserSkip(&parser);
+        } else if (status == PARSE_FRAME) {
+            *f = parser.frame;
+            return 1;
+        }
+    }
+}
+
+// Pass every received frame to its handler until one reports an event in
+// stop. Frames without a handler are dropped whole, the parser is already
+// past their closing FLAG.
+// Returns the events of that handler, 0 if the timer expired or -1 on error.
+int dispatchFrames(frame_handler handlers[2][CTRL_KINDS], int stop) {
+    frame_info f;
+    int res;
+
+    while ((res = receiveFrame(&f)) == 1) {
+        ctrl_kind_t kind;
+        int n = frameNumber(&f, &kind);
+        frame_handler handler = handlers[ADDRESS_INDEX(f.a)][kind];
+
+        if (handler == NULL)
+            continue;
+
+        res = handler(&f, kind, n);
+        if (res < 0 || (res & stop))
+            return res;
+    }
+
+    return res;
+}
+
+// The frame the wait was for
+int frameExpected(const frame_info *f, ctrl_kind_t kind, int n) {
+    return FRAME_EXPECTED;
+}
+
+////////////////////////////////////////////////
+// PARAMETER NEGOTIATION
+////////////////////////////////////////////////
+// The transmitter offers everything it supports in the data field of its
+// first SET and the receiver answers with the values it picked in the UA.
+// A station that does not negotiate drops a SET with a data field as a
+// malformed frame, so the following SETs are bare, and a bare SET or UA
+// means both ends fall back to the original protocol.
+link_params peer_params;        /* Parameters of the last SET or UA */
+int peer_negotiates = FALSE;    /* It carried a parameter block */
+unsigned char ua_frame[HANDSHAKE_MAX_SIZE];    /* UA sent by the receiver, repeated for every SET */
+int ua_size = 0;
+
+// Parameters of a station that does not negotiate: the original protocol,
+// stop-and-wait with INF_0/1, RR and REJ, BCC2, ESC stuffing and packets of
+// at most LEGACY_PAYLOAD_SIZE bytes
+void legacyParams(link_params *p) {
+    p->arq = 1 << ARQ_STOP_AND_WAIT;
+    p->fcs = 1 << FCS_XOR;
+    p->fec = 1 << FEC_NONE;
+    p->compression = 1 << COMPRESSION_NONE;
+    p->framing = 1 << FRAMING_ESCAPE;
+    p->scrambling = 1 << SCRAMBLING_NONE;
+    p->batching = 1 << BATCHING_NONE;
+    p->handshake_data = 1 << HANDSHAKE_DATA_NONE;
+    p->keepalive = 1 << KEEPALIVE_FRAME;
+    p->seq_bits = 1;
+    p->window = 1;
+    p->max_payload = LEGACY_PAYLOAD_SIZE;
+}
+
+// Everything this station supports
+void localParams(link_params *p) {
+    legacyParams(p);
+    p->seq_bits = SEQ_BITS;
+    p->window = WINDOW_SIZE;
+    p->max_payload = MAX_PAYLOAD_SIZE;
+    p->arq = ARQ_SUPPORTED;
+    p->fcs = FCS_SUPPORTED;
+    p->fec = FEC_SUPPORTED;
+    p->compression = COMPRESSION_SUPPORTED;
+    p->framing = FRAMING_SUPPORTED;
+    p->scrambling = SCRAMBLING_SUPPORTED;
+    p->batching = BATCHING_SUPPORTED;
+    p->handshake_data = HANDSHAKE_DATA_SUPPORTED;
+    p->keepalive = KEEPALIVE_SUPPORTED;
+}
+
+// Configure the link for single-valued parameters: agreed ones or the defaults
+void applyParams(const link_params *p, int negotiated) {
+    cfg.arq = paramsValue(p->arq);
+    cfg.fcs = paramsValue(p->fcs);
+    cfg.fec = paramsValue(p->fec);
+    cfg.compression = paramsValue(p->compression);
+    cfg.framing = paramsValue(p->framing);
+    // COBS has nothing to escape
+    cfg.scrambling = cfg.framing == FRAMING_ESCAPE ? paramsValue(p->scrambling) : SCRAMBLING_NONE;
+    cfg.batching = paramsValue(p->batching);
+    cfg.handshake_data = paramsValue(p->handshake_data);
+    cfg.keepalive = paramsValue(p->keepalive);
+    cfg.max_payload = p->max_payload;
+    // The original application sends packets longer than it promised
+    cfg.rx_payload = negotiated ? p->max_payload : MAX_PAYLOAD_SIZE;
+    cfg.negotiated = negotiated;
+
+    if (cfg.arq == ARQ_GO_BACK_N) {
+        cfg.modulo = 1 << p->seq_bits;
+        cfg.window = p->window < cfg.modulo ? p->window : cfg.modulo - 1;
+    } else if (cfg.arq == ARQ_SELECTIVE_REPEAT) {
+        // Both windows together must fit in the sequence space
+        cfg.modulo = 1 << p->seq_bits;
+        cfg.window = p->window <= cfg.modulo / 2 ? p->window : cfg.modulo / 2;
+    } else {
+        cfg.modulo = 2;
+        cfg.window = 1;
+    }
+
+    parserSetup();
+}
+
+// SET or UA: keep the parameters it carries, and the packet of a SET. A
+// damaged block is dropped like a frame failing its FCS.
+int handshakeReceived(const frame_info *f, ctrl_kind_t kind, int n) {
+    legacyParams(&peer_params);
+    peer_negotiates = f->received && f->size > 0;
+
+    if (peer_negotiates && paramsDecode(&peer_params, f->buffer, f->size) < 0)
+        return 0;
+    if (kind == CTRL_SET)
+        open_packet_size = peer_negotiates ? paramsData(f->buffer, f->size, open_packet) : -1;
+    return FRAME_EXPECTED;
+}
+
+// Wait for the SET or UA with address a, as kind says.
+// With timeout set the wait ends at the first timeout.
+// Returns 0 once it is received, -1 on timeout or error.
+int receiveSupervision(unsigned char a, ctrl_kind_t kind, int timeout) {
+    frame_handler handlers[2][CTRL_KINDS] = {{NULL}};
+
+    handlers[ADDRESS_INDEX(a)][kind] = handshakeReceived;
+
+    while (TRUE) {
+        int res = dispatchFrames(handlers, FRAME_EXPECTED);
+        if (res > 0)
+            return 0;
+        if (res < 0 || timeout)
+            return -1;
+    }
+}
+
+int llopen(LinkLayer connectionParameters)
+{
+    return llopenWith(connectionParameters, NULL, 0);
+}
+
+int llopenWith(LinkLayer connectionParameters, const unsigned char *packet, int packetSize)
+{
+    int dl_identifier = openSerialPort(connectionParameters.serialPort, connectionParameters.baudRate);
+    if (dl_identifier < 0) return -1;
+    
+    connectionParams = connectionParameters;
+
+    cfg.timeout_ms = connectionParameters.timeout * 1000;
+    rttInit(cfg.timeout_ms);
+
+    // The original protocol holds until the other end agrees on better ones
+    link_params local, agreed;
+    localParams(&local);
+    legacyParams(&agreed);
+    parserInit(&parser, 2, FCS_XOR);
+    applyParams(&agreed, FALSE);
+    disc_received = FALSE;
+    link_failed = FALSE;
+    outage_start = 0;
+    outage_origin = 0;
+    open_packet_size = -1;
+    close_packet_size = -1;
+
+    // The packet rides in the first SET, along with our parameters
+    int offered = packet != NULL && packetSize <= NEG_DATA_MAX && connectionParameters.role == LlTx;
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (timer_fd < 0) {
+        perror("timerfd_create");
+        closeSerialPort();
+        return -1;
+    }
+
+    int retransmissions = connectionParameters.nRetransmissions;
+    unsigned char frame[HANDSHAKE_MAX_SIZE];
+    int connected = FALSE;
+
+    switch (connectionParameters.role)
+    {
+
+    case LlTx:
+        while (timeoutCount < retransmissions){
+            // Only the first SET offers our parameters, in case the other
+            // end does not negotiate
+            int size = timeoutCount == 0
+                ? handshakeFrame(frame, A_TX, SET, &local, offered ? packet : NULL, packetSize)
+                : handshakeFrame(frame, A_TX, SET, NULL, NULL, 0);
+            writeAll(frame, size);
+            startTimer(rtt.rto);
+
+            if (receiveSupervision(A_RX, CTRL_UA, TRUE) == 0) {
+                connected = TRUE;
+                break;
+            }
+        }
+        clearTimer();
+
+        if (!connected) {
+            // Cancel the procedure, maximum number of retransmissions exceeded
+            printf("Maximum number of retransmissions exceeded!\n");
+            return -1;
+        }
+
+        // The UA holds the values the receiver picked
+        if (peer_negotiates) {
+            if (paramsAgree(&local, &peer_params, &agreed) < 0) {
+                printf("ERROR: the receiver picked unsupported link parameters\n");
+                return -1;
+            }
+            applyParams(&agreed, TRUE);
+        }
+        printf("Successfully connected!\n");
+        break;
+
+    case LlRx:
+        // Nothing was sent yet, so nothing can time out: the timer stays
+        // disarmed until the SET arrives
+        if (receiveSupervision(A_TX, CTRL_SET, FALSE) < 0) {
+            printf("ERROR: cannot receive the SET\n");
+            return -1;
+        }
+
+        // Answer in kind: a bare UA keeps the defaults
+        if (peer_negotiates && paramsAgree(&local, &peer_params, &agreed) == 0) {
+            applyParams(&agreed, TRUE);
+            ua_size = handshakeFrame(ua_frame, A_RX, UA, &agreed, NULL, 0);
+        } else
+            ua_size = handshakeFrame(ua_frame, A_RX, UA, NULL, NULL, 0);
+        if (cfg.handshake_data == HANDSHAKE_DATA_NONE)
+            open_packet_size = -1;
+        else if (open_packet_size >= 0)
+            stats.handshake_packets++;
+        writeAll(ua_frame, ua_size);
+        printf("Successfully connected!\n");
+        break;
+
+    default:
+        return -1;
+        break;
+    }
+
+    // Every transmit buffer is allocated here, for the agreed payload size
+    // and window; llwrite only reuses them. Both ends may send I-frames.
+    payloadInit();
+    if (allocateFramePool() < 0) {
+        printf("ERROR: cannot allocate the frame pool\n");
+        close(timer_fd);
+        timer_fd = -1;
+        closeSerialPort();
+        return -1;
+    }
+
+    if (RX_THREAD && startLinkThread() < 0) {
+        printf("ERROR: cannot start the link thread\n");
+        close(timer_fd);
+        timer_fd = -1;
+        closeSerialPort();
+        return -1;
+    }
+    
+    stats.start_us = nowUs();
+
+    // A UA with handshake data agreed answers the SET that carried the
+    // packet. Otherwise it was dropped, or the SET never offered it.
+    if (offered && cfg.handshake_data != HANDSHAKE_DATA_NONE)
+        stats.handshake_packets++;
+    else if (packet != NULL && llwrite(packet, packetSize) < 0)
+        return -1;
+
+    return dl_identifier;
+}
+
+
+// I-frame header: FLAG A C [N(S) N(R)] BCC1, acknowledging every frame
+// received before rx_next. Its size depends on the escapes it needs, so
+// it is written to end at f_buf + HEADER_MAX_SIZE, where the data field
+// starts, and can be rewritten there with another N(R).
+// Returns its size.
+int frameHeader(unsigned char *f_buf, int ns) {
+    unsigned char ctrl[3] = {0};
+    unsigned char header[HEADER_MAX_SIZE];
+    int ctrl_size = encodeControl(ctrl, CTRL_I, ns, rx_next);
+    if (window[ns].compressed)
+        ctrl[0] |= I_COMPRESSED;
+    if (window[ns].batched)
+        ctrl[0] |= I_BATCH;
+
+    int size = buildHeader(header, localAddress(), ctrl, ctrl_size);
+    memcpy(f_buf + HEADER_MAX_SIZE - size, header, size);
+
+    return size;
+}
+
+#define CHECK_MAX_SIZE ( FCS_MAX_SIZE + FEC_MAX_SIZE(MAX_PAYLOAD_SIZE + FCS_MAX_SIZE) )
+
+// FCS and FEC parity of the payload, written to out before framing.
+// bcc2 is the XOR of the payload (the FCS for FCS_XOR). Returns their size.
+int frameCheck(unsigned char *out, const unsigned char *buf, int bufSize, unsigned char bcc2) {
+    int fcs_size = fcsSize(cfg.fcs);
+
+    if (cfg.fcs == FCS_XOR)
+        out[0] = bcc2;
+    else
+        fcsStore(cfg.fcs, fcsUpdate(cfg.fcs, fcsInit(cfg.fcs), buf, bufSize), out);
+
+    if (cfg.fec == FEC_NONE)
+        return fcs_size;
+
+    // Reed-Solomon parity over data and FCS
+    fec_encoder encoder;
+    fecEncodeInit(&encoder, bufSize + fcs_size, out + fcs_size);
+    fecEncodeUpdate(&encoder, buf, bufSize);
+    fecEncodeUpdate(&encoder, out, fcs_size);
+
+    return fcs_size + fecSize(cfg.fec, bufSize + fcs_size);
+}
+
+// I-frame trailer: FCS and FEC parity of the payload, stuffed like the
+// data, then the closing FLAG. bcc2 is the XOR of the payload.
+// Returns its size.
+int frameTrailer(unsigned char *out, const unsigned char *buf, int bufSize, unsigned char bcc2) {
+    unsigned char check[CHECK_MAX_SIZE];
+    int size = frameCheck(check, buf, bufSize, bcc2);
+    int num_bytes = stuffBytes(out, check, size, &bcc2);
+
+    out[num_bytes++] = FLAG;
+
+    return num_bytes;
+}
+
+// COBS data field: payload, FCS and FEC parity encoded as one block, then
+// the closing FLAG. Returns its size.
+int cobsDataField(unsigned char *out, const unsigned char *buf, int bufSize) {
+    unsigned char check[CHECK_MAX_SIZE];
+    int size = frameCheck(check, buf, bufSize, cfg.fcs == FCS_XOR ? fcsUpdate(FCS_XOR, 0, buf, bufSize) : 0);
+    cobs_encoder encoder;
+
+    cobsEncodeInit(&encoder, out);
+    cobsEncodeUpdate(&encoder, buf, bufSize);
+    cobsEncodeUpdate(&encoder, check, size);
+    int num_bytes = cobsEncodeFinal(&encoder);
+
+    out[num_bytes++] = FLAG;
+
+    return num_bytes;
+}
+
+// Whole I-frame in f_buf, described by iov. Returns its size.
+int prepare_frame(struct iovec *iov, unsigned char *f_buf, const unsigned char *buf, int bufSize, int ns) {
+    int header = frameHeader(f_buf, ns);
+    unsigned char *data = f_buf + HEADER_MAX_SIZE;
+    int num_bytes = 0;
+    unsigned char bcc2 = 0;
+
+    if (cfg.framing == FRAMING_COBS)
+        num_bytes = cobsDataField(data, buf, bufSize);
+    else {
+        // Data packet, stuffed and checksummed in a single pass
+        num_bytes = stuffBytes(data, buf, bufSize, &bcc2);
+        num_bytes += frameTrailer(data + num_bytes, buf, bufSize, bcc2);
+    }
+
+    iov->iov_base = data - header;
+    iov->iov_len = header + num_bytes;
+
+    return iov->iov_len;
+}
+
+// Zero-copy I-frame: header and trailer are built in f_buf and the payload
+// is described where it is by iovecs, so buf must stay unchanged until
+// the frame is acknowledged. Returns the number of iovecs in iov.
+int prepare_frame_vector(struct iovec *iov, unsigned char *f_buf, const unsigned char *buf, int bufSize, int ns) {
+    int header = frameHeader(f_buf, ns);
+    int n = 0;
+
+    iov[n].iov_base = f_buf + HEADER_MAX_SIZE - header;
+    iov[n++].iov_len = header;
+
+    n += stuffVector(&iov[n], buf, bufSize);
+
+    unsigned char bcc2 = cfg.fcs == FCS_XOR ? fcsUpdate(FCS_XOR, 0, buf, bufSize) : 0;
+    iov[n].iov_base = f_buf + HEADER_MAX_SIZE;
+    iov[n++].iov_len = frameTrailer(f_buf + HEADER_MAX_SIZE, buf, bufSize, bcc2);
+
+    return n;
+}
+
+// Copy a zero-copy frame into its pool buffer, once the caller's buffer
+// may no longer hold the payload
+void keepFrame(int n) {
+    tx_slot *slot = &window[n];
+    if (slot->iovcnt == 1)
+        return;
+
+    // The header already sits in front of the data field, the trailer
+    // where the data field starts
+    unsigned char trailer[2 * CHECK_MAX_SIZE + 1];
+    struct iovec *last = &slot->iov[slot->iovcnt - 1];
+    int trailer_size = last->iov_len;
+    memcpy(trailer, last->iov_base, trailer_size);
+
+    unsigned char *data = slot->frame + HEADER_MAX_SIZE;
+    int size = 0;
+    for (int i = 1; i < slot->iovcnt - 1; i++) {
+        memcpy(data + size, slot->iov[i].iov_base, slot->iov[i].iov_len);
+        size += slot->iov[i].iov_len;
+    }
+    memcpy(data + size, trailer, trailer_size);
+
+    slot->iov[0].iov_len += size + trailer_size;
+    slot->iovcnt = 1;
+}
+
+// Account for the time the line stayed idle before a new I-frame: since the
+// previous frame left the port or, if the window was full, since the
+// acknowledgement that made room for this one
+void recordGap() {
+    if (stats.frames == 0 && OUTSTANDING() == 0)
+        return; // First I-frame, nothing to compare with
+
+    long long idle = line_free_us > room_us ? line_free_us : room_us;
+    long long gap = nowUs() - idle;
+    if (gap < 0)
+        gap = 0;
+
+    stats.gap_us += gap;
+    if ((unsigned long long) gap > stats.gap_max_us)
+        stats.gap_max_us = gap;
+    stats.gaps++;
+}
+
+// Send the frame in window slot n
+int sendWindowFrame(int n) {
+    // The header is written again on every transmission, so that it
+    // carries the current N(R): an old one could acknowledge frames the
+    // other end has not sent yet once the sequence numbers wrap
+    if (ack_pending) {
+        stats.piggybacked_sent++;
+        ack_pending = FALSE;
+    }
+    // The first iovec starts with the header and ends in the data field,
+    // where it stays
+    struct iovec *first = &window[n].iov[0];
+    unsigned char *end = (unsigned char *) first->iov_base + first->iov_len;
+    unsigned char *start = window[n].frame + HEADER_MAX_SIZE - frameHeader(window[n].frame, n);
+    window[n].size += (int) (end - start) - (int) first->iov_len;
+    first->iov_base = start;
+    first->iov_len = end - start;
+
+    int res = sendFrameVector(window[n].iov, window[n].iovcnt);
+    window[n].done_us = line_free_us;
+    return res;
+}
+
+// Timeout for frame n in ms: time left to send it plus the RTO
+int frameTimeout(int n) {
+    long long left = (window[n].done_us - nowUs()) / 1000;
+    return (left > 0 ? left : 0) + rtt.rto;
+}
+
+// Resend every outstanding frame starting at sequence number n (Go-Back-N)
+void retransmitFrom(int n) {
+    for (; n != frame_to_send; n = NEXT_FRAME(n)) {
+        sendWindowFrame(n);
+        window[n].retransmitted = TRUE;
+        stats.retransmissions++;
+    }
+}
+
+// Resend frame n only, after a SREJ or its own timeout (Selective Repeat)
+void retransmitFrame(int n) {
+    sendWindowFrame(n);
+    window[n].retransmitted = TRUE;
+    window[n].deadline = nowMs() + frameTimeout(n);
+    stats.retransmissions++;
+}
+
+// Check the per-frame timers of the outstanding frames (Selective Repeat).
+// Returns -1 if a frame exceeded the maximum number of retransmissions.
+int checkFrameTimers() {
+    long long now = nowMs();
+
+    for (int n = window_base; n != frame_to_send; n = NEXT_FRAME(n)) {
+        if (now < window[n].deadline)
+            continue;
+
+        if (window[n].retries >= connectionParams.nRetransmissions)
+            return -1;
+
+        printf("Timeout on frame %d\n", n);
+        window[n].retries++;
+        payloadShrink(window[n].payload);
+        retransmitFrame(n);
+    }
+
+    return 0;
+}
+
+// Arm the timer for the earliest per-frame deadline (Selective Repeat)
+void scheduleFrameTimer() {
+    if (OUTSTANDING() == 0) {
+        clearTimer();
+        return;
+    }
+
+    long long first = window[window_base].deadline;
+    for (int n = window_base; n != frame_to_send; n = NEXT_FRAME(n))
+        if (window[n].deadline < first)
+            first = window[n].deadline;
+
+    startTimer(first - nowMs());
+}
+
+// OUTAGE RESUME
+// Once the retransmissions give up, the cable may just be out. Keepalives
+// are sent, further and further apart, until the other end answers and
+// the session goes on with the sequence state both ends kept, without a
+// new SET/UA exchange.
+
+// One keepalive: a PROBE, answered with an RR, or with a peer that does
+// not take them the oldest outstanding frame, which any receiver answers
+void sendProbe() {
+    if (cfg.keepalive == KEEPALIVE_PROBE)
+        sendSupervision(localAddress(), PROBE);
+    else
+        retransmitFrame(window_base);
+    stats.probes++;
+}
+
+// The retransmissions gave up or the last probe went unanswered: send the
+// next probe, starting the outage on the first one.
+// Returns -1 once the outage lasted RESUME_TIME_MS, counted from the first
+// probe if no resume since acknowledged anything.
+int probeLink() {
+    long long now = nowMs();
+
+    if (outage_start == 0) {
+        outage_start = now;
+        probe_ms = PROBE_MIN_MS;
+        if (outage_origin == 0) {
+            outage_origin = now;
+            stats.outages++;
+            if (RESUME_TIME_MS > 0)
+                printf("Link down, probing for %d s\n", RESUME_TIME_MS / 1000);
+        }
+    }
+    if (now - outage_origin >= RESUME_TIME_MS) {
+        stats.outage_ms += now - outage_start;
+        outage_start = 0;
+        outage_origin = 0;
+        return -1;
+    }
+
+    sendProbe();
+    long long left = (line_free_us - nowUs()) / 1000;
+    startTimer((left > 0 ? left : 0) + probe_ms);
+    probe_ms = 2 * probe_ms < PROBE_MAX_MS ? 2 * probe_ms : PROBE_MAX_MS;
+
+    return 0;
+}
+
+// The other end answered a probe, or sent anything: drop the backoff and
+// resend every frame it has not acknowledged. A peer that answers without
+// ever acknowledging does not restart the outage: progress is FALSE keeps
+// it counting towards RESUME_TIME_MS.
+void resumeLink(int progress) {
+    stats.outage_ms += nowMs() - outage_start;
+    stats.resumes++;
+    outage_start = 0;
+    if (progress)
+        outage_origin = 0;
+    printf("Link resumed\n");
+
+    rttRestore();
+    clearTimer();
+    for (int n = window_base; n != frame_to_send; n = NEXT_FRAME(n))
+        window[n].retries = 0;
+    if (OUTSTANDING() == 0)
+        return;
+
+    if (cfg.arq == ARQ_SELECTIVE_REPEAT) {
+        for (int n = window_base; n != frame_to_send; n = NEXT_FRAME(n))
+            retransmitFrame(n);
+        scheduleFrameTimer();
+    } else {
+        retransmitFrom(window_base);
+        startTimer(frameTimeout(window_base));
+    }
+}
+
+// Acknowledge every outstanding frame before sequence number n.
+// Returns the number of newly acknowledged frames or -1 if n is outside the window.
+int acknowledgeUpTo(int n) {
+    int acked = (n - window_base + cfg.modulo) % cfg.modulo;
+
+    if (acked > OUTSTANDING())
+        return -1;
+
+    // RTT sample from the newest acknowledged frame, unless it was resent
+    if (acked > 0) {
+        tx_slot *last = &window[(n - 1 + cfg.modulo) % cfg.modulo];
+        if (!last->retransmitted)
+            rttSample(nowUs() > last->done_us ? (nowUs() - last->done_us) / 1000.0 : 0);
+    }
+
+    long long now = nowUs();
+    for (int i = window_base; i != n; i = NEXT_FRAME(i)) {
+        if (window[i].request.done != NULL) {
+            completeRequest(&window[i].request, window[i].payload);
+            window[i].request.done = NULL;
+        }
+
+        if (window[i].retransmitted)
+            continue;
+        payloadGrow();
+        stats.latency[latencyBucket(now > window[i].done_us ? now - window[i].done_us : 0)]++;
+    }
+
+    window_base = n;
+    stats.frames += acked;
+    if (acked > 0) {
+        room_us = nowUs();
+        outage_origin = 0;
+    }
+
+    return acked;
+}
+
+// Acknowledge our frames before n and, for a REJ, go back to n.
+// Returns FRAME_ACKED if some frames were acknowledged.
+int slideWindow(ctrl_kind_t kind, int n) {
+    int acked = acknowledgeUpTo(n);
+    if (acked < 0)
+        return 0; // Stale acknowledgement
+
+    if (outage_start > 0) {
+        resumeLink(acked > 0);
+        return acked > 0 ? FRAME_ACKED : 0;
+    }
+
+    if (kind == CTRL_REJ && n != frame_to_send) {
+        payloadShrink(window[n].payload);
+        retransmitFrom(n);
+    }
+
+    if (cfg.arq != ARQ_SELECTIVE_REPEAT && (acked > 0 || kind == CTRL_REJ)) {
+        // Restart the timer for the remaining outstanding frames
+        clearTimer();
+        if (OUTSTANDING() > 0)
+            startTimer(frameTimeout(window_base));
+    }
+
+    return acked > 0 ? FRAME_ACKED : 0;
+}
+
+// RR or REJ from the other end
+int ackReceived(const frame_info *f, ctrl_kind_t kind, int n) {
+    if (kind == CTRL_RR)
+        stats.rr_received++;
+    else
+        stats.rej_received++;
+
+    return slideWindow(kind, n);
+}
+
+// SREJ from the other end: resend that frame only
+int srejReceived(const frame_info *f, ctrl_kind_t kind, int n) {
+    stats.srej_received++;
+
+    if (outage_start > 0) {
+        resumeLink(FALSE);
+        return 0;
+    }
+
+    // Only resend frames still in the window. A resend asked for counts as
+    // a retry, and once they are used up the frame's own timer gives up.
+    if ((n - window_base + cfg.modulo) % cfg.modulo < OUTSTANDING()
+        && window[n].retries < connectionParams.nRetransmissions) {
+        window[n].retries++;
+        payloadShrink(window[n].payload);
+        retransmitFrame(n);
+        scheduleFrameTimer();
+    }
+
+    return 0;
+}
+
+// Resend what the expired timer covers. Go-Back-N sends every outstanding
+// frame again while Selective Repeat only resends the frames whose own
+// timer expired.
+// Returns -1 if the maximum number of retransmissions was exceeded.
+int retransmitExpired() {
+    if (cfg.arq == ARQ_SELECTIVE_REPEAT) {
+        if (checkFrameTimers() < 0)
+            return -1;
+        scheduleFrameTimer();
+        return 0;
+    }
+
+    if (timeoutCount >= connectionParams.nRetransmissions)
+        return -1;
+    payloadShrink(window[window_base].payload);
+    retransmitFrom(window_base);
+    startTimer(frameTimeout(window_base));
+
+    return 0;
+}
+
+// The retransmission timer expired: retransmit or, once that gave up,
+// probe the other end.
+// Returns -1 if the link failed: the outage outlasted RESUME_TIME_MS.
+int retransmissionTimeout() {
+    if (link_failed)
+        return -1;
+    if (OUTSTANDING() == 0)
+        return 0;
+
+    if (outage_start == 0 && retransmitExpired() == 0)
+        return 0;
+    if (probeLink() == 0)
+        return 0;
+
+    link_failed = TRUE;
+    return -1;
+}
+
+// Next sequence number missing from the receive buffer, starting at n
+int firstMissing(int n) {
+    while (reorder[n].valid)
+        n = NEXT_FRAME(n);
+    return n;
+}
+
+// Keep an out-of-order frame and SREJ every frame still missing before it
+void storeOutOfOrder(int ns, int size) {
+    reorder[ns].size = size;
+    reorder[ns].valid = TRUE;
+
+    for (int n = rx_next; n != ns; n = NEXT_FRAME(n)) {
+        if (!reorder[n].valid && !reorder[n].srej_sent) {
+            sendAck(CTRL_SREJ, n);
+            reorder[n].srej_sent = TRUE;
+        }
+    }
+}
+
+// The I-frame was not destuffed: a copy of a frame already received, a
+// frame after a gap (Go-Back-N) or one that does not fit yet
+void iFrameSkipped(int ns) {
+    int ahead = (ns - rx_next + cfg.modulo) % cfg.modulo;
+
+    if (cfg.arq == ARQ_SELECTIVE_REPEAT) {
+        // No room until llread passes frames up: no answer, it comes again
+        if (ahead < cfg.window && !reorder[ns].valid)
+            return;
+
+        // Already received, the RR must have been lost
+        stats.duplicates++;
+        sendAck(CTRL_RR, rx_next);
+        // A buffered frame being resent means the SREJ for the frame
+        // still missing may be lost too
+        if (ahead < cfg.window)
+            sendAck(CTRL_SREJ, rx_next);
+        return;
+    }
+
+    if (ahead == 0)
+        return; // No room until llread passes frames up
+
+    int behind = (rx_next - ns + cfg.modulo) % cfg.modulo;
+    if (behind >= 1 && behind <= cfg.window) {
+        // Duplicate of an already accepted frame
+        stats.duplicates++;
+        sendAck(CTRL_RR, rx_next);
+    } else if (!reject_sent) {
+        // Frames were lost, ask for a go back
+        sendAck(CTRL_REJ, rx_next);
+        reject_sent = TRUE;
+    }
+}
+
+// Number of packets in a batch, or -1 unless their lengths cover it exactly
+int batchPackets(const unsigned char *data, int size) {
+    int count = 0;
+
+    for (int i = 0; i < size; count++) {
+        if (i + BATCH_PREFIX_SIZE > size)
+            return -1;
+        i += BATCH_PREFIX_SIZE + (data[i] << 8 | data[i + 1]);
+        if (i > size)
+            return -1;
+    }
+    return count > 0 ? count : -1;
+}
+
+// I-frame from the other end: take the acknowledgement it carries, then
+// check its data field and pass it up to llread, keep it until llread is
+// called, or ask for it again
+int iFrameReceived(const frame_info *f, ctrl_kind_t kind, int ns) {
+    int events = slideWindow(CTRL_RR, frameAck(f));
+    if (events & FRAME_ACKED)
+        stats.piggybacked_received++;
+
+    if (!f->received) {
+        iFrameSkipped(ns);
+        return events;
+    }
+
+    // The FCS went through the frame check with the data
+    int size = f->size;
+    unsigned int check = f->check;
+    int corrected = 0;
+
+    if (cfg.fec != FEC_NONE) {
+        // Repair data and FCS first, the check then runs without the parity
+        corrected = fecDecode(cfg.fec, f->buffer, f->size, &size);
+        check = fcsUpdate(cfg.fcs, fcsInit(cfg.fcs), f->buffer, size);
+    }
+
+    int valid = size >= fcsSize(cfg.fcs) && fcsCheck(cfg.fcs, check);
+    int char_read = size - fcsSize(cfg.fcs); // FCS is not part of the packet
+
+    // Unscrambled and moved over its mask, in place
+    if (valid && cfg.scrambling != SCRAMBLING_NONE) {
+        valid = char_read >= 1;
+        if (valid) {
+            char_read--;
+            scrambleBytes(f->buffer, f->buffer + 1, char_read, f->buffer[0]);
+        }
+    }
+    int carried = char_read;
+
+    // A compressed payload replaces its frame in the buffer it was
+    // destuffed to
+    if (valid && (f->c & I_COMPRESSED)) {
+        char_read = decompressBlock(f->buffer, carried, inflated, cfg.rx_payload);
+        valid = char_read >= 0;
+        if (valid)
+            memcpy(f->buffer, inflated, char_read);
+    }
+
+    int packets = 1;
+    if (valid && (f->c & I_BATCH)) {
+        packets = batchPackets(f->buffer, char_read);
+        valid = packets > 0;
+    }
 
+    if (!valid) {
+        stats.bcc2_errors++;
+        if (cfg.arq == ARQ_SELECTIVE_REPEAT){
+            // Header is intact so only this frame has to be resent.
+            // Sent even if this was the copy a SREJ asked for.
+            sendAck(CTRL_SREJ, ns);
+            reorder[ns].srej_sent = TRUE;
+        }
+        else{
+            sendAck(CTRL_REJ, rx_next);
+            reject_sent = TRUE;
+        }
+        return events;
+    }
 
-unsigned char frame_expected = 0;
+    if (corrected > 0) {
+        stats.fec_corrected += corrected;
+        stats.fec_saved++;
+    }
+    stats.i_received++;
+    stats.payload_bytes += char_read;
+    stats.carried_bytes += carried;
+    if (f->c & I_COMPRESSED)
+        stats.compressed++;
+    if (f->c & I_BATCH) {
+        stats.batches++;
+        stats.batched_packets += packets;
+    }
 
-// COMMS STATISTICS
-typedef struct {
-    unsigned int frames;
-    unsigned int retransmissions;
-} comms_stats;
+    reorder[ns].batched = (f->c & I_BATCH) != 0;
+    reorder[ns].offset = 0;
+    if (ns != rx_next) {
+        storeOutOfOrder(ns, char_read);
+        return events;
+    }
 
-comms_stats stats;
+    if (f->buffer == rx_frame) {
+        memcpy(rx_packet, rx_frame, char_read);
+        rx_size = char_read;
+        frame_expected = NEXT_FRAME(ns);
+        events |= FRAME_DELIVERED;
+    } else {
+        reorder[ns].size = char_read;
+        reorder[ns].valid = TRUE;
+        events |= FRAME_STORED;
+    }
+    reorder[ns].srej_sent = FALSE;
+    reject_sent = FALSE;
 
-typedef enum {
-	START_RCV,      /* Start of the receiving process */
-	FLAG_OK,        /* Start flag ok */
-	A_OK,           /* Address field ok */
-    A_OK_RX,        /* Address field ok (commands from rx and replies from tx) */
-	C_OK,           /* Control field ok */
-	BCC_OK,         /* BCC field ok */
-	STOP_RCV        /* Stop the receiving process */
-} state_t;
+    // Acknowledge it and everything buffered behind it, in the next RR or
+    // in the next I-frame sent
+    rx_next = firstMissing(NEXT_FRAME(ns));
+    ack_pending = TRUE;
 
-LinkLayer connectionParams;
+    return events;
+}
 
+// SET again: the UA was lost, so the transmitter still waits for it
+int setReceived(const frame_info *f, ctrl_kind_t kind, int n) {
+    writeAll(ua_frame, ua_size);
+    return 0;
+}
 
-int frame_to_send = 0;
+// PROBE from the other end after an outage: tell it the first frame we miss
+int probeReceived(const frame_info *f, ctrl_kind_t kind, int n) {
+    sendAck(CTRL_RR, rx_next);
+    return 0;
+}
 
+// DISC from the other end: it has nothing more to send, but the first
+// one may carry its last packet. A damaged block is dropped like a frame
+// failing its FCS.
+int discReceived(const frame_info *f, ctrl_kind_t kind, int n) {
+    if (!disc_received && f->received && f->size > 0) {
+        close_packet_size = paramsData(f->buffer, f->size, close_packet);
+        if (close_packet_size < 0)
+            return 0;
+        stats.handshake_packets++;
+    }
 
-int alarmEnabled = FALSE;
-int alarmCount = 0;
+    disc_received = TRUE;
+    return FRAME_DISC;
+}
 
-// Alarm function handler
-void alarmHandler(int signal)
-{
-    alarmEnabled = FALSE;
-    alarmCount++;
+// Frames handled while data flows, in both directions at once: the
+// acknowledgements of our I-frames and the other end's I-frames
+frame_handler transfer_handlers[2][CTRL_KINDS] = {
+    [LOCAL] = {
+        [CTRL_RR] = ackReceived,
+        [CTRL_REJ] = ackReceived,
+        [CTRL_SREJ] = srejReceived,
+    },
+    [REMOTE] = {
+        [CTRL_I] = iFrameReceived,
+        [CTRL_SET] = setReceived,
+        [CTRL_DISC] = discReceived,
+        [CTRL_PROBE] = probeReceived,
+    },
+};
 
-    printf("Alarm #%d\n", alarmCount);
+////////////////////////////////////////////////
+// PACKET RING
+////////////////////////////////////////////////
+// Copy the oldest packet accepted but not passed up yet into packet. A
+// batch is passed up one packet at a time and its frame released with the
+// last one.
+// Returns its size.
+int takeBacklog(unsigned char *packet) {
+    rx_slot *slot = &reorder[frame_expected];
+    int size = slot->size;
+
+    if (slot->batched) {
+        const unsigned char *prefix = slot->data + slot->offset;
+        size = prefix[0] << 8 | prefix[1];
+        memcpy(packet, prefix + BATCH_PREFIX_SIZE, size);
+        slot->offset += BATCH_PREFIX_SIZE + size;
+        if (slot->offset < slot->size)
+            return size;
+    } else
+        memcpy(packet, slot->data, size);
+
+    slot->valid = FALSE;
+    slot->srej_sent = FALSE;
+    frame_expected = NEXT_FRAME(frame_expected);
+    return size;
 }
 
-void enableAlarm(int time) {
-    alarm(time);
-    alarmEnabled = TRUE;
+// Copy the packet of a SET or DISC into packet, once.
+// Returns its size.
+int takeHandshakePacket(unsigned char *packet, const unsigned char *data, int *size) {
+    int res = *size;
+
+    memcpy(packet, data, res);
+    *size = -1;
+    return res;
 }
 
-void clearAlarm() {
-    alarm(0);
-    alarmCount = 0;
+// Copy the next packet to pass up into packet: the one the SET carried,
+// those accepted in order, then the one the DISC carried.
+// Returns its size, or -1 if there is none yet.
+int takePacket(unsigned char *packet) {
+    if (open_packet_size >= 0)
+        return takeHandshakePacket(packet, open_packet, &open_packet_size);
+    if (backlog() > 0)
+        return takeBacklog(packet);
+    if (close_packet_size >= 0)
+        return takeHandshakePacket(packet, close_packet, &close_packet_size);
+    return -1;
 }
 
+// Move the packets accepted in order to the ring while it has room. The
+// rest stay in the receive buffer, which holds up the window of the other
+// end until llread makes room.
+// Returns the number of packets moved.
+int fillRing() {
+    unsigned char *slot;
+    int moved = 0;
+
+    while ((slot = ringSlot(&rx_ring)) != NULL) {
+        int size = takePacket(slot);
+        if (size < 0)
+            break;
+        ringPush(&rx_ring, size);
+        moved++;
+    }
+    return moved;
+}
 
-void printStatistics() {
-    printf("Number of frames = %d\n", stats.frames);
-    printf("Number of retransmissions = %d\n", stats.retransmissions);
+// Sleep, with link_lock held, until the link thread handles an
+// acknowledgement.
+// Returns -1 if it gave up retransmitting.
+int waitLinkThread() {
+    int base = window_base;
+
+    while (window_base == base && !link_failed)
+        pthread_cond_wait(&link_cond, &link_lock);
+
+    return link_failed ? -1 : 0;
 }
 
+// Wait for the other end to acknowledge some of our frames, retransmitting
+// on timeouts.
+// Returns 0 once at least one frame was acknowledged, or -1 if the maximum
+// number of retransmissions was exceeded.
+int waitWriteResponse() {
+    if (link_failed)
+        return -1;
+    if (thread_running)
+        return waitLinkThread();
 
-int receiveSupervision(unsigned char a, unsigned char c, int timeout) {
-    char byte;
-
-    state_t state = START_RCV;
-
-    while (state != STOP_RCV) {
-		
-        if (readByte(&byte) == 1) {
-           // printf("Read byte = 0x%02X\n", byte);
-
-            
-            switch (state) {
-                
-                case START_RCV:
-                    if (byte == FLAG) 
-                        state = FLAG_OK;
-                    break;
-                    
-                case FLAG_OK:
-                    if (byte == a)
-                        state = A_OK;
-                    else if (byte != FLAG)
-                        state = START_RCV;
-                    break;
-                    
-                case A_OK:
-                    if (byte == FLAG)
-                        state = FLAG_OK;
-                    else if (byte == c)
-                        state = C_OK;
-                    else 
-                        state = START_RCV;
-                    break;
-                    
-                case C_OK:
-                    if (byte == FLAG)
-                        state = FLAG_OK;
-                    else if (byte == (a ^ c))
-                        state = BCC_OK;
-                    else 
-                        state = START_RCV;
-                    break;
-                    
-                case BCC_OK:
-                    if (byte == FLAG)
-                        state = STOP_RCV;
-                    else 
-                        state = START_RCV;
-                    break;
-                    
-                default:
-                    printf("ERROR: Wrong state (%d) in 'receiving supervision frame' state machine", state);
-                    break;
-            }
+    if (cfg.arq == ARQ_SELECTIVE_REPEAT && outage_start == 0)
+        scheduleFrameTimer();
 
-        }
-        // Timeout only if sender is waiting for acknowledgement
-        if (timeout == TRUE && alarmEnabled == FALSE) {
-            stats.retransmissions++;
-            printf("Timeout %d", alarmCount);
+    while (TRUE) {
+        int res = dispatchFrames(transfer_handlers, FRAME_ACKED);
+        if (res != 0)
+            return res > 0 ? 0 : -1;
+
+        if (retransmissionTimeout() < 0)
             return -1;
-        }
-	}
+    }
+}
 
-    printf("--------END OF FRAME-------\n");
+
+// Wait until a new frame fits in the transmit window.
+// Returns -1 if the maximum number of retransmissions was exceeded.
+int waitForRoom() {
+    while (OUTSTANDING() >= cfg.window) {
+        if (waitWriteResponse() < 0) {
+            printf("Maximum number of retransmissions exceeded!\n");
+            clearTimer();
+            return -1;
+        }
+    }
 
     return 0;
 }
 
-int sendSupervision(unsigned char a, unsigned char c) {
-    // Create frame to send
-    char frame[5] = {0};
+////////////////////////////////////////////////
+// LLWRITE
+////////////////////////////////////////////////
+// Encode and send one I-frame, link_lock held
+int writeFrame(const unsigned char *buf, int bufSize, int batched) {
+    if (bufSize > cfg.max_payload) {
+        printf("ERROR: payload of %d bytes is longer than %d\n", bufSize, cfg.max_payload);
+        return -1;
+    }
 
-    frame[0] = FLAG;
-    frame[1] = a;
-    frame[2] = c;
-    frame[3] = a ^ c;
-    frame[4] = FLAG;
+    // The frame is encoded ahead, while the earlier ones are in flight, and
+    // goes on the wire as soon as an acknowledgement makes room for it.
+    // The pool keeps a spare buffer for it past the full window.
+    tx_slot *slot = &window[frame_to_send];
+    slot->frame = frame_pool + (size_t) pool_next * frame_capacity;
+    slot->iov = iov_pool + (size_t) pool_next * iov_per_frame;
+    pool_next = (pool_next + 1) % (cfg.window + 1);
+    slot->request.done = NULL;
+
+    // Sent compressed only if that makes it shorter
+    const unsigned char *data = buf;
+    int size = bufSize;
+    slot->compressed = FALSE;
+    if (cfg.compression != COMPRESSION_NONE) {
+        int res = compressBlock(buf, bufSize, deflated, bufSize - 1);
+        if (res > 0) {
+            data = deflated;
+            size = res;
+            slot->compressed = TRUE;
+            stats.compressed++;
+        }
+    }
+    int carried = size;
+
+    // Then XOR-ed with the mask that leaves the fewest bytes to escape,
+    // sent in front of it
+    if (cfg.scrambling != SCRAMBLING_NONE) {
+        int plain, masked;
+        unsigned char mask = scrambleMask(data, size, &plain, &masked);
+
+        scrambled[0] = mask;
+        scrambleBytes(scrambled + 1, data, size, mask);
+        data = scrambled;
+        size++;
+
+        if (mask != 0)
+            stats.scrambled++;
+        stats.plain_escapes += plain;
+        stats.masked_escapes += masked;
+    }
+
+    if (ZERO_COPY()) {
+        slot->iovcnt = prepare_frame_vector(slot->iov, slot->frame, data, size, frame_to_send);
+        slot->size = 0;
+        for (int i = 0; i < slot->iovcnt; i++)
+            slot->size += slot->iov[i].iov_len;
+    } else {
+        slot->size = prepare_frame(slot->iov, slot->frame, data, size, frame_to_send);
+        slot->iovcnt = 1;
+    }
 
-    // Write the frame until all 5 bytes are written
-    while (writeBytes(frame, 5) != 5);
+    slot->payload = bufSize;
+    slot->retransmitted = FALSE;
+    slot->batched = batched;
 
-    return 0;
+    if (waitForRoom() < 0)
+        return -1;
+
+    recordGap();
+    if (sendWindowFrame(frame_to_send) < 0) {
+        printf("ERROR: writeBytes() failed\n");
+        return -1;
+    }
+
+    unsigned char ctrl[3];
+    int overhead = 3 + encodeControl(ctrl, CTRL_I, 0, 0) + 1; // Header and closing FLAG
+    stats.i_sent++;
+    stats.payload_bytes += bufSize;
+    stats.carried_bytes += carried;
+    stats.frame_bytes += slot->size;
+    stats.field_bytes += dataFieldSize(size);
+    stats.stuffed_bytes += slot->size - overhead - dataFieldSize(size);
+    if (cfg.arq == ARQ_SELECTIVE_REPEAT) {
+        slot->deadline = nowMs() + frameTimeout(frame_to_send);
+        slot->retries = 0;
+    } else if (OUTSTANDING() == 0)
+        startTimer(frameTimeout(frame_to_send));
+    frame_to_send = NEXT_FRAME(frame_to_send);
+
+    // Armed now, the frame timers also run while llread waits. During an
+    // outage the timer paces the probes instead.
+    if (cfg.arq == ARQ_SELECTIVE_REPEAT && outage_start == 0)
+        scheduleFrameTimer();
+
+    return bufSize;
 }
 
-////////////////////////////////////////////////
-// LLOPEN
-////////////////////////////////////////////////
-int llopen(LinkLayer connectionParameters)
+// Send one I-frame and, with zero-copy, wait for its acknowledgement,
+// link_lock held
+int sendPayload(const unsigned char *buf, int bufSize, int batched) {
+    // Nothing retransmits the frame once the link thread gave up
+    int res = link_failed ? -1 : writeFrame(buf, bufSize, batched);
+
+    // The zero-copy frame points into buf, so stop-and-wait returns only
+    // once it was acknowledged
+    if (res > 0 && ZERO_COPY() && waitForRoom() < 0) {
+        // Still outstanding, but buf belongs to the caller again
+        keepFrame(window_base);
+        res = -1;
+    }
+
+    return res;
+}
+
+int llwrite(const unsigned char *buf, int bufSize)
 {
-    int dl_identifier = openSeialPort(connectionParameters.serialPort, connectionParameters.baudRate);
-    if (dl_identifier < 0) return -1;
-    
-    connectionParams = connectionParameters;
+    pthread_mutex_lock(&link_lock);
+    int res = sendPayload(buf, bufSize, FALSE);
+    pthread_mutex_unlock(&link_lock);
 
-    (void)signal(SIGALRM, alarmHandler);
+    return res;
+}
 
-    int retransmissions = connectionParameters.nRetransmissions;
+// Packets llwritev packs in one frame, each behind its length
+unsigned char batch[MAX_PAYLOAD_SIZE];
 
-    switch (connectionParameters.role)
-    {
+int llwritev(const struct iovec *packets, int count)
+{
+    int total = 0;
+
+    pthread_mutex_lock(&link_lock);
+    for (int i = 0; i < count; ) {
+        // As many packets as fit in the payload size llpayloadsize() asks for
+        int n = 0, size = 0;
+        while (cfg.batching != BATCHING_NONE && i + n < count
+               && size + BATCH_PREFIX_SIZE + (int) packets[i + n].iov_len <= payload.size) {
+            size += BATCH_PREFIX_SIZE + packets[i + n].iov_len;
+            n++;
+        }
 
-    case LlTx:
-        while (alarmCount < retransmissions){
-            sendSupervision(A_TX,SET);
-            enableAlarm(connectionParameters.timeout);
-
-            if (receiveSupervision(A_RX, UA,1) == 0) {
-                    clearAlarm();
-                    printf("Successfully connected!\n");
-                    break;
-                }
+        int res;
+        if (n < 2) {
+            // Alone in its frame, as llwrite sends it
+            n = 1;
+            res = sendPayload(packets[i].iov_base, packets[i].iov_len, FALSE);
+        } else {
+            size = 0;
+            for (int k = i; k < i + n; k++) {
+                int len = packets[k].iov_len;
+                batch[size] = len >> 8;
+                batch[size + 1] = len & 0xFF;
+                memcpy(batch + size + BATCH_PREFIX_SIZE, packets[k].iov_base, len);
+                size += BATCH_PREFIX_SIZE + len;
+            }
 
-            // Cancel the procedure, maximum number of retransmissions exceeded
-            clearAlarm();
-            printf("Maximum number of retransmissions exceeded!\n");
-            return -1;
+            res = sendPayload(batch, size, TRUE);
+            if (res > 0) {
+                stats.batches++;
+                stats.batched_packets += n;
+            }
         }
-        break;
 
-    case LlRx:
-         while (1){
-            enableAlarm(connectionParameters.timeout);
-
-            if (receiveSupervision(A_TX, SET,0) == 0) {
-                    sendSupervision(A_RX,UA);
-                    clearAlarm();
-                    printf("Successfully connected!\n");
-                    break;
-                }
+        if (res < 0) {
+            total = -1;
+            break;
+        }
+        for (int k = i; k < i + n; k++)
+            total += packets[k].iov_len;
+        i += n;
+    }
+    pthread_mutex_unlock(&link_lock);
 
-            // Cancel the procedure, maximum number of retransmissions exceeded
-            clearAlarm();
+    return total;
+}
+
+int llpayloadsize()
+{
+    return payload.size;
+}
+
+// Wait until every outstanding frame, and every queued asynchronous
+// write, is acknowledged.
+// Returns -1 if the maximum number of retransmissions was exceeded.
+int flushWindow() {
+    while (OUTSTANDING() > 0 || write_queue.count > 0) {
+        if (waitWriteResponse() < 0) {
             printf("Maximum number of retransmissions exceeded!\n");
+            clearTimer();
             return -1;
-         }
-        break;
+        }
+    }
 
-    default:
-        return -1;
-        break;
+    clearTimer();
+    return 0;
+}
+
+////////////////////////////////////////////////
+// LINK THREAD
+////////////////////////////////////////////////
+// Send the queued asynchronous writes that fit in the window, link_lock
+// held
+void submitWrites() {
+    async_request r;
+
+    while (!link_failed && OUTSTANDING() < cfg.window && queuePop(&write_queue, &r) == 0) {
+        int n = frame_to_send;
+        if (writeFrame(r.buf, r.size, FALSE) < 0)
+            completeRequest(&r, -1);
+        else
+            window[n].request = r;
     }
-    
-    return dl_identifier;
 }
 
+// Fail every asynchronous write, queued or in the window, link_lock held
+void failWrites() {
+    async_request r;
 
-int prepare_frame(char *f_buf, const unsigned char *buf, int bufSize) {
-    f_buf[0] = FLAG;
-    f_buf[1] = A_TX;
-    f_buf[2] = INF_(frame_to_send);
-    f_buf[3] = f_buf[1] ^ f_buf[2];
+    for (int n = window_base; n != frame_to_send; n = NEXT_FRAME(n)) {
+        if (window[n].request.done != NULL) {
+            completeRequest(&window[n].request, -1);
+            window[n].request.done = NULL;
+        }
+    }
+    while (queuePop(&write_queue, &r) == 0)
+        completeRequest(&r, -1);
+}
 
-    int num_bytes = 4;
-    char bcc2 = 0;
+// Receive, acknowledge and retransmit until llclose stops the thread or
+// the maximum number of retransmissions is exceeded. Every RR goes out as
+// soon as the frames before it are parsed, whether llread is waiting or
+// not, and llwrite only sleeps until an acknowledgement makes room.
+void *linkThread(void *arg) {
+    pthread_mutex_lock(&link_lock);
+
+    while (!thread_stop) {
+        int res = dispatchFrames(transfer_handlers, FRAME_ACKED | FRAME_STORED | FRAME_DISC);
+        if (res == 0 && !thread_stop && retransmissionTimeout() < 0)
+            res = -1;
+        if (res < 0) {
+            clearTimer();
+            link_failed = TRUE;
+            failWrites();
+        } else if (res & FRAME_ACKED)
+            submitWrites();
+
+        pthread_cond_broadcast(&link_cond);
+        if (fillRing() > 0 || res < 0 || (res & FRAME_DISC))
+            signalLink();
+        if (link_failed)
+            break;
+    }
 
-    // Data packet
-    for (int i = 0; i < bufSize; i++, num_bytes++) {
+    pthread_mutex_unlock(&link_lock);
+    return NULL;
+}
 
-        if (buf[i] == FLAG || buf[i] == ESC) {
-            // Data byte needs to be stuffed
-            f_buf[num_bytes++] = ESC;
-            f_buf[num_bytes] = buf[i] ^ 0x20;
-        } else {
-            f_buf[num_bytes] = buf[i];
-        }
+// Start receiving on the link thread, once connected.
+// Returns -1 if it cannot be started.
+int startLinkThread() {
+    // Slots also hold the packet of a SET or DISC
+    if (ringInit(&rx_ring, RING_SLOTS, cfg.rx_payload > NEG_DATA_MAX ? cfg.rx_payload : NEG_DATA_MAX) < 0)
+        return -1;
+    fillRing();
 
-        bcc2 ^= buf[i];
+    link_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (link_event < 0) {
+        ringFree(&rx_ring);
+        return -1;
     }
 
-    if (bcc2 == FLAG || bcc2 == ESC) {
-        // BCC2 Needs to be stuffed
-        f_buf[num_bytes++] = ESC;
-        f_buf[num_bytes++] = bcc2 ^ 0x20;
-    } else {
-        f_buf[num_bytes++] = bcc2;
+    thread_stop = FALSE;
+    link_failed = FALSE;
+    thread_running = TRUE;
+    if (pthread_create(&link_thread, NULL, linkThread, NULL) != 0) {
+        thread_running = FALSE;
+        close(link_event);
+        link_event = -1;
+        ringFree(&rx_ring);
+        return -1;
     }
 
-    f_buf[num_bytes++] = FLAG;
+    return 0;
+}
 
-    return num_bytes;
+// Stop the link thread, which the timer wakes up, and receive on the
+// calling thread again. Packets llread did not take are dropped.
+void stopLinkThread() {
+    if (!thread_running)
+        return;
+
+    pthread_mutex_lock(&link_lock);
+    thread_stop = TRUE;
+    startTimer(0);
+    pthread_mutex_unlock(&link_lock);
+
+    pthread_join(link_thread, NULL);
+    thread_running = FALSE;
+    thread_stop = FALSE;
+    stopTimer();
+
+    close(link_event);
+    link_event = -1;
+    ringFree(&rx_ring);
 }
 
-int waitWriteResponse() {
-    state_t state = START_RCV;
-    unsigned char c = 0;
-
-    while (state != STOP_RCV) {
-        unsigned char byte;
-
-        if ( readByte(&byte) == 1 ) {
-            // printf("Read byte = 0x%02X\n", byte);
-            
-            switch (state) {
-                
-                case START_RCV:
-                    if (byte == FLAG) 
-                        state = FLAG_OK;
-                    break;
-                    
-                case FLAG_OK:
-                    if (byte == A_TX)
-                        state = A_OK;
-                    else if (byte != FLAG)
-                        state = START_RCV;
-                    break;
-                    
-                case A_OK:
-                    if (byte == FLAG)
-                        state = FLAG_OK;
-                    else if ( (byte == REJ(frame_to_send)) | (byte == RR(NEXT_FRAME(frame_to_send))) ) {
-                        c = byte;
-                        state = C_OK;
-                    } else 
-                        state = START_RCV;
-                    break;
-                    
-                case C_OK:
-                    if (byte == FLAG)
-                        state = FLAG_OK;
-                    else if (byte == (A_TX ^ c))
-                        state = BCC_OK;
-                    else 
-                        state = START_RCV;
-                    break;
-                    
-                case BCC_OK:
-                    if (byte == FLAG)
-                        state = STOP_RCV;
-                    else 
-                        state = START_RCV;
-                    break;
-
-                default:
-                    printf("ERROR: Wrong state (%d) in 'receiving supervision frame' state machine", state);
-                    break;
-            }
+////////////////////////////////////////////////
+// LLREAD
+////////////////////////////////////////////////
+// Copy the oldest packet of the ring into packet. The link thread may
+// have left packets that did not fit in the receive buffer, so fillRing()
+// must be called with link_lock held once it returns a packet.
+// Returns its size, or -1 if the ring is empty.
+int popRing(unsigned char *packet) {
+    int size;
+
+    const unsigned char *data = ringFront(&rx_ring, &size);
+    if (data == NULL)
+        return -1;
+
+    memcpy(packet, data, size);
+    ringPop(&rx_ring);
+    return size;
+}
+
+// Sleep until link_event is signalled, up to timeoutMs, and reset it.
+// Returns -1 on error.
+int waitLinkEvent(int timeoutMs) {
+    struct pollfd pfd = {.fd = link_event, .events = POLLIN};
+    uint64_t events;
+
+    if (poll(&pfd, 1, timeoutMs) < 0 && errno != EINTR)
+        return -1;
+    if (read(link_event, &events, sizeof(events)) < 0 && errno != EAGAIN)
+        return -1;
+    return 0;
+}
+
+// Pop the next packet the link thread passed up, sleeping until there is
+// one. Popping needs no lock; link_lock is taken to move the packets left
+// in the receive buffer to the freed slot, or to learn why the ring stays
+// empty. Whether the ring was full cannot be sampled without the lock:
+// the link thread may fill it right after.
+// Returns -1 once the other end disconnected or the link failed.
+int readRing(unsigned char *packet) {
+    while (TRUE) {
+        int size = popRing(packet);
+
+        if (size >= 0) {
+            pthread_mutex_lock(&link_lock);
+            fillRing();
+            pthread_mutex_unlock(&link_lock);
+            return size;
         }
 
-        if (alarmEnabled == FALSE) {
-            // Timeout
-            stats.retransmissions++;
+        pthread_mutex_lock(&link_lock);
+        int ended = disc_received || link_failed;
+        pthread_mutex_unlock(&link_lock);
+
+        // Packets pushed before the DISC were popped above
+        if (ended && ringCount(&rx_ring) == 0) {
+            if (link_failed)
+                printf("Maximum number of retransmissions exceeded!\n");
             return -1;
         }
-    }
 
-    if (c == RR(NEXT_FRAME(frame_to_send)))
-        return 0;
-    return -1;
+        if (!ended && waitLinkEvent(-1) < 0)
+            return -1;
+    }
 }
 
-
-////////////////////////////////////////////////
-// LLWRITE
-////////////////////////////////////////////////
-int llwrite(const unsigned char *buf, int bufSize)
+int llread(unsigned char *packet)
 {
+    if (thread_running) {
+        // The ring has a single consumer: llpoll while reads are queued,
+        // llread otherwise
+        pthread_mutex_lock(&link_lock);
+        int busy = ring_reader || read_queue.count > 0;
+        if (!busy)
+            ring_reader = TRUE;
+        pthread_mutex_unlock(&link_lock);
+        if (busy) {
+            printf("ERROR: llread called while other reads are pending\n");
+            return -1;
+        }
 
-    // for (int i = 0; i < bufSize; i++)
-    //     printf("byte written: 0x%02X\n",buf[i]);
-    // Frame buffer, data bytes (bufSize) + 4 other field bytes + 2 flags
-    // If all bytes are stuffed then number of bytes is doubled with the exception of the start and end flags
-    unsigned char f_buf[2 *(bufSize + 4) + 2];
+        int size = readRing(packet);
+        pthread_mutex_lock(&link_lock);
+        ring_reader = FALSE;
+        pthread_mutex_unlock(&link_lock);
+        return size;
+    }
 
-    int frameSize = prepare_frame(f_buf, buf, bufSize);
+    while (TRUE) {
+        // Frames received before llread was called are passed up first
+        int size = takePacket(packet);
+        if (size >= 0)
+            return size;
 
-    while (alarmCount < connectionParams.nRetransmissions) {
-        // Send frame
-        if (writeBytes(f_buf, frameSize) != frameSize) {
-            printf("ERROR: writeBytes() didn't write all bytes\n");
-            continue; // so para quando escrever
-        }
-        enableAlarm(connectionParams.timeout);
-
-        // Wait for response
-        if (waitWriteResponse() == 0) {
-            // Frame successfully akcnowledged
-            clearAlarm();
-            stats.frames++;
-            frame_to_send = NEXT_FRAME(frame_to_send);
-            return bufSize;
-        } else {
-            // Frame rejected or timeout
-            alarm(0);
-            stats.retransmissions++;
+        if (disc_received)
+            return -1;
+
+        rx_packet = packet;
+        int res = dispatchFrames(transfer_handlers, FRAME_DELIVERED | FRAME_STORED | FRAME_DISC);
+        rx_packet = NULL;
+
+        if (res & FRAME_DELIVERED)
+            return rx_size;
+        // A batch, or the packet of a DISC, is passed up from its buffer
+        if (res > 0 && (res & (FRAME_STORED | FRAME_DISC)))
+            continue;
+        if (res != 0)
+            return -1;
+
+        // Our own I-frames timed out while waiting
+        if (retransmissionTimeout() < 0) {
+            printf("Maximum number of retransmissions exceeded!\n");
+            clearTimer();
+            return -1;
         }
     }
+}
 
-    printf("Maximum number of retransmissions exceeded!\n");
-    clearAlarm();
-    return -1;
+
+// Wait for the DISC of the other end. Its I-frames are still acknowledged,
+// the RR for the last ones may have been lost.
+// With timeout set the wait ends at the first timeout.
+// Returns 0 once it is received, -1 on timeout or error.
+int waitPeerDisc(int timeout) {
+    static frame_handler handlers[2][CTRL_KINDS] = {
+        [REMOTE] = {
+            [CTRL_I] = iFrameReceived,
+            [CTRL_DISC] = discReceived,
+        },
+    };
+
+    while (TRUE) {
+        int res = dispatchFrames(handlers, FRAME_DISC);
+        if (res > 0)
+            return 0;
+        if (res < 0 || timeout)
+            return -1;
+    }
 }
 
-////////////////////////////////////////////////
-// LLREAD
-////////////////////////////////////////////////
-int llread(unsigned char *packet)
-{
-    unsigned char byte,c_byte;
-    state_t state = START_RCV;
-    int char_read = 0;
-    unsigned char escape_next=0;
-    unsigned char bcc = 0;
+// Wait for the UA closing the connection.
+// Returns 0 once it is received, -1 on timeout, error or a repeated DISC.
+int waitDiscResponse() {
+    static frame_handler handlers[2][CTRL_KINDS] = {
+        [LOCAL] = {
+            [CTRL_UA] = frameExpected,
+        },
+        [REMOTE] = {
+            [CTRL_I] = iFrameReceived,
+            [CTRL_DISC] = discReceived,
+        },
+    };
+
+    return dispatchFrames(handlers, FRAME_EXPECTED | FRAME_DISC) == FRAME_EXPECTED ? 0 : -1;
+}
 
-    while (state!= STOP_RCV){
 
-        if (readByte(&byte) == 1) {
-        
-            switch (state)
-            {
-            case START_RCV:
-                if (byte == FLAG)
-                    state = FLAG_OK;
-                break;
 
-            case FLAG_OK:
 
-                if (byte == A_TX){
-                    state = A_OK;
-                    }
-                else if (byte !=FLAG)
-                    state = START_RCV;
-                break;
+////////////////////////////////////////////////
+// ASYNCHRONOUS API
+////////////////////////////////////////////////
+// Fill the pending asynchronous reads from the ring, link_lock held. Once
+// the other end disconnected or the link failed, the reads left fail.
+void serveReads() {
+    async_request r;
 
-            case A_OK:
-
-                if (byte == INF_0 || byte == INF_1){
-                    c_byte = byte;
-                    byte = byte >> 7;
-                    if (byte == frame_expected){
-                    state = C_OK;
-                    }
-                    else{
-                        if(frame_expected) {
-                            sendSupervision(A_TX, RR1);
-                            state = START_RCV;
-                        }
-                    else{
-                        sendSupervision (A_TX,RR0);
-                        state = START_RCV;
-                        }
-                    }
-                }
-                else if (byte == FLAG)
-                    state = FLAG_OK;
-                else 
-                    state = START_RCV;
-                break;
-        
-            case C_OK:
-                    // printf("c ok\n");
+    while (read_queue.count > 0) {
+        async_request *next = &read_queue.items[read_queue.head];
+        int size = popRing(next->packet);
 
-                if (byte == (A_TX ^ c_byte)){
-                    state = BCC_OK;
-                }
-                else if (byte == FLAG)
-                    state = FLAG_OK;
-                else 
-                    state = START_RCV;
-                break;
-            
-            case BCC_OK:
-                    // printf("bcc ok\n");
-
-                if (byte == FLAG) {
-                    //verificar bbc2, criar funcao
-                    int i = char_read - 1;
-                    unsigned char bcc2 = packet[i--];
-                    
-                    while (i>=0){
-                        bcc ^= packet[i--];
-
-                    }
-                    if (bcc == bcc2){
-
-                        frame_expected ^= 0x01; //want to receive next packet
-                        sendSupervision(A_TX, RR(frame_expected));
-
-                        state = STOP_RCV;
-                    }
-                    else{
-                        if(frame_expected) {
-                            sendSupervision(A_TX, REJ1);
-                        }
-                            
-                    else {
-                            sendSupervision (A_TX,REJ0);
-                        }
-                        char_read = 0;
-                        bcc = 0;
-                        state = START_RCV;
-                    }
-
-                } else if (byte == ESC) {
-                    escape_next = 1;
-                } else {
-                    if (escape_next) {
-                        byte ^= 0x20;
-                        escape_next = 0;
-                    }
-                    packet[char_read++] = byte;
-                }
-                break;
+        if (size < 0 && !disc_received && !link_failed)
+            return;
+        fillRing();
 
-            default:
-                printf("Wrong state");
-                break;
-            }
-        }
+        queuePop(&read_queue, &r);
+        completeRequest(&r, size);
     }
-        
+}
 
-     return char_read;
+// Accept one more request, link_lock held.
+// Returns -1 if too many are pending.
+int acceptRequest() {
+    if (async_pending == ASYNC_REQUESTS)
+        return -1;
+    async_pending++;
+    return 0;
 }
 
+int llwriteAsync(const unsigned char *buf, int bufSize, LinkLayerCallback done, void *arg)
+{
+    async_request r = {.done = done, .arg = arg, .buf = buf, .size = bufSize};
 
-int waitDiscResponse() {
-    state_t state = START_RCV;
-    char c = 0;
-    char a = 0;
-
-    while (state != STOP_RCV) {
-        char byte;
-
-        if ( readByte(&byte) == 1 ) {
-            switch (state) {
-                
-                case START_RCV:
-                    if (byte == FLAG) 
-                        state = FLAG_OK;
-                    break;
-                    
-                case FLAG_OK:
-                    if (byte == A_TX) {
-                        a = byte;
-                        state = A_OK;
-                    } else if (byte == A_RX) {
-                        a = byte;
-                        state = A_OK_RX;
-                    } else if (byte != FLAG)
-                        state = START_RCV;
-                    break;
-                    
-                case A_OK:
-                    if (byte == FLAG)
-                        state = FLAG_OK;
-                    else if (byte == DISC) {
-                        c = byte;
-                        state = C_OK;
-                    } else 
-                        state = START_RCV;
-                    break;
-
-                case A_OK_RX:
-                    if (byte == FLAG)
-                        state = FLAG_OK;
-                    else if (byte == UA) {
-                        c = byte;
-                        state = C_OK;
-                    } else 
-                        state = START_RCV;
-                    break;
-                    
-                case C_OK:
-                    if (byte == FLAG)
-                        state = FLAG_OK;
-                    else if (byte == (a ^ c))
-                        state = BCC_OK;
-                    else 
-                        state = START_RCV;
-                    break;
-                    
-                case BCC_OK:
-                    if (byte == FLAG)
-                        state = STOP_RCV;
-                    else 
-                        state = START_RCV;
-                    break;
-
-                default:
-                    printf("ERROR: Wrong state (%d) in 'receiving supervision frame' state machine", state);
-                    break;
-            }
-        }
+    if (bufSize > cfg.max_payload) {
+        printf("ERROR: payload of %d bytes is longer than %d\n", bufSize, cfg.max_payload);
+        return -1;
+    }
 
-        if (alarmEnabled == FALSE) {
-            // Timeout
-            stats.retransmissions++;
-            printf("Timeout %d", alarmCount);
-            return -1;
-        }
+    pthread_mutex_lock(&link_lock);
+    if (link_failed || acceptRequest() < 0) {
+        pthread_mutex_unlock(&link_lock);
+        return -1;
     }
+    if (thread_running) {
+        queuePush(&write_queue, &r);
+        submitWrites();
+        pthread_mutex_unlock(&link_lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&link_lock);
+
+    // Without the link thread nothing serves the queue: sent right away
+    int res = llwrite(buf, bufSize);
+    pthread_mutex_lock(&link_lock);
+    completeRequest(&r, res);
+    pthread_mutex_unlock(&link_lock);
+
+    return 0;
+}
+
+int llreadAsync(unsigned char *packet, LinkLayerCallback done, void *arg)
+{
+    async_request r = {.done = done, .arg = arg, .packet = packet};
 
-    if (c == UA)
+    pthread_mutex_lock(&link_lock);
+    if (ring_reader) {
+        pthread_mutex_unlock(&link_lock);
+        printf("ERROR: llreadAsync called while llread waits\n");
+        return -1;
+    }
+    if (acceptRequest() < 0) {
+        pthread_mutex_unlock(&link_lock);
+        return -1;
+    }
+    if (thread_running) {
+        // Served by llpoll, the consumer of the ring
+        queuePush(&read_queue, &r);
+        signalLink();
+        pthread_mutex_unlock(&link_lock);
         return 0;
-    return -1;
+    }
+    pthread_mutex_unlock(&link_lock);
+
+    int res = llread(packet);
+    pthread_mutex_lock(&link_lock);
+    completeRequest(&r, res);
+    pthread_mutex_unlock(&link_lock);
+
+    return 0;
+}
+
+int llfd()
+{
+    return link_event;
 }
 
+int llpoll(int timeoutMs)
+{
+    async_request done[ASYNC_REQUESTS];
+    int count = 0;
+
+    // Reset first: an event signalled from now on is seen by the next wait
+    if (link_event >= 0 && waitLinkEvent(0) < 0)
+        return -1;
+
+    while (TRUE) {
+        pthread_mutex_lock(&link_lock);
+        serveReads();
+        while (queuePop(&completions, &done[count]) == 0)
+            count++;
+        async_pending -= count;
+        pthread_mutex_unlock(&link_lock);
+
+        if (count > 0 || timeoutMs == 0 || link_event < 0)
+            break;
+        if (waitLinkEvent(timeoutMs) < 0)
+            return -1;
+        // One wait only: timed out or not, report what completed
+        timeoutMs = 0;
+    }
 
+    for (int i = 0; i < count; i++)
+        done[i].done(done[i].arg, done[i].size);
 
+    return count;
+}
 
 ////////////////////////////////////////////////
 // LLCLOSE
 ////////////////////////////////////////////////
 int llclose(int showStatistics)
 {
+    return llcloseWith(showStatistics, NULL, 0);
+}
+
+int llcloseWith(int showStatistics, const unsigned char *packet, int packetSize)
+{
+    // The packet rides in our DISC if the other end takes it there,
+    // otherwise it is one more I-frame
+    int carried = packet != NULL && packetSize <= NEG_DATA_MAX && connectionParams.role == LlTx
+                  && cfg.handshake_data != HANDSHAKE_DATA_NONE;
+    int written = carried || packet == NULL ? 0 : llwrite(packet, packetSize);
+
+    // Every I-frame must be acknowledged before disconnecting, ours by the
+    // other end and the last ones received by us. The disconnection then
+    // runs on this thread.
+    pthread_mutex_lock(&link_lock);
+    int flushed = written < 0 ? -1 : flushWindow();
+    pthread_mutex_unlock(&link_lock);
+    stopLinkThread();
+
+    // Requests whose callback did not run are dropped
+    write_queue.count = 0;
+    read_queue.count = 0;
+    completions.count = 0;
+    async_pending = 0;
+
+    if (flushed < 0) {
+        closeSerialPort();
+        return -1;
+    }
+    if (ack_pending)
+        sendAck(CTRL_RR, rx_next);
+
     if (connectionParams.role == LlTx) {
+        unsigned char disc[HANDSHAKE_MAX_SIZE];
+        int disc_size = handshakeFrame(disc, A_TX, DISC, NULL, carried ? packet : NULL, packetSize);
+        if (carried)
+            stats.handshake_packets++;
 
         while (TRUE) {
 
-            // Send DISC frame
-            sendSupervision(A_TX, DISC);
-            enableAlarm(connectionParams.timeout);
+            // Send DISC frame, with the packet every time
+            writeAll(disc, disc_size);
+            startTimer(rtt.rto);
 
             // Successfully receives DISC
-            if (receiveSupervision(A_RX, DISC, TRUE) == 0) {
-                clearAlarm();
+            if (waitPeerDisc(TRUE) == 0) {
+                clearTimer();
                 sendSupervision(A_RX, UA);
                 printf("Successfully disconnected!\n");
                 break;
             }
 
             // Cancel the procedure, maximum number of retransmissions exceeded
-            if (alarmCount >= connectionParams.nRetransmissions) {
-                clearAlarm();
+            if (timeoutCount >= connectionParams.nRetransmissions) {
+                clearTimer();
                 printf("Maximum number of retransmissions exceeded!\n");
                 return -1;
             }
 
+            // DISC is sent again
+            stats.retransmissions++;
         }
         
     } else if (connectionParams.role == LlRx) {
 
-        receiveSupervision(A_TX, DISC, FALSE);
+        // llread may have received it already
+        if (!disc_received)
+            waitPeerDisc(FALSE);
 
         while (TRUE) {
 
             // Send DISC frame
             sendSupervision(A_RX, DISC);
-            enableAlarm(connectionParams.timeout);
+            startTimer(rtt.rto);
 
             if (waitDiscResponse() == 0) {
                 // Successfully receives UA
-                clearAlarm();
+                clearTimer();
                 printf("Successfully disconnected!\n");
                 break;
             } else {
                 // Timeout or DISC received
-                alarm(0);
-                stats.retransmissions++; // ta em dois sitios
+                stopTimer();
             }
 
             // Cancel the procedure, maximum number of retransmissions exceeded
-            if (alarmCount >= connectionParams.nRetransmissions) {
-                clearAlarm();
+            if (timeoutCount >= connectionParams.nRetransmissions) {
+                clearTimer();
                 printf("Maximum number of retransmissions exceeded!\n");
 
                 closeSerialPort(); // deve fechar
 
                 return -1;
             }
+
+            // DISC is sent again
+            stats.retransmissions++;
         }
 
     }
 
+    for (int i = 0; i < MAX_MODULO; i++) {
+        window[i].frame = NULL;
+        window[i].iov = NULL;
+        free(reorder[i].data);
+        reorder[i].data = NULL;
+        reorder[i].capacity = 0;
+    }
+    free(rx_frame);
+    rx_frame = NULL;
+    free(frame_pool);
+    frame_pool = NULL;
+    free(iov_pool);
+    iov_pool = NULL;
+
+    close(timer_fd);
+    timer_fd = -1;
+
+    stats.end_us = nowUs();
+    stats.bcc1_errors = parser.header_errors;
     int clstat = closeSerialPort();
 
-    if (showStatistics == TRUE)
+    if (showStatistics == TRUE) {
         printStatistics();
 
+        const char *json = getenv(STATS_JSON_ENV);
+        if (json != NULL)
+            writeStatisticsJson(json);
+    }
+
     return clstat;
 }
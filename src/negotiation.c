@@ -0,0 +1,165 @@
+// Link parameter negotiation implementation
+
+#include "negotiation.h"
+#include "fcs.h"
+
+#include <string.h>
+
+#define NEG_CHECK FCS_CRC16     /* Protects the block whatever FCS the link uses */
+#define MAX_SEQ_BITS 7
+
+
+static int putEntry(unsigned char *out, int type, unsigned int value, int len) {
+    out[0] = type;
+    out[1] = len;
+    for (int i = len - 1; i >= 0; i--) {
+        out[2 + i] = value & 0xFF;
+        value >>= 8;
+    }
+    return 2 + len;
+}
+
+static unsigned int highestBit(unsigned int mask) {
+    unsigned int bit = 0;
+    while (mask) {
+        bit = mask & -mask;
+        mask &= mask - 1;
+    }
+    return bit;
+}
+
+static unsigned int lowestBit(unsigned int mask) {
+    return mask & -mask;
+}
+
+static int smallest(int a, int b) {
+    return a < b ? a : b;
+}
+
+
+int paramsEncode(const link_params *p, const unsigned char *data, int size, unsigned char *out) {
+    int len = 0;
+
+    if (p != NULL) {
+        len += putEntry(out + len, NEG_ARQ, p->arq, 1);
+        len += putEntry(out + len, NEG_SEQ_BITS, p->seq_bits, 1);
+        len += putEntry(out + len, NEG_WINDOW, p->window, 1);
+        len += putEntry(out + len, NEG_MAX_PAYLOAD, p->max_payload, 2);
+        len += putEntry(out + len, NEG_FCS, p->fcs, 1);
+        len += putEntry(out + len, NEG_FEC, p->fec, 1);
+        len += putEntry(out + len, NEG_COMPRESSION, p->compression, 1);
+        len += putEntry(out + len, NEG_FRAMING, p->framing, 1);
+        len += putEntry(out + len, NEG_SCRAMBLING, p->scrambling, 1);
+        len += putEntry(out + len, NEG_BATCHING, p->batching, 1);
+        len += putEntry(out + len, NEG_HANDSHAKE_DATA, p->handshake_data, 1);
+        len += putEntry(out + len, NEG_KEEPALIVE, p->keepalive, 1);
+    }
+
+    // An empty packet still gets one entry, so it is told from none
+    for (int i = 0; data != NULL && (i < size || i == 0); i += NEG_DATA_CHUNK) {
+        int chunk = size - i < NEG_DATA_CHUNK ? size - i : NEG_DATA_CHUNK;
+        out[len] = NEG_DATA;
+        out[len + 1] = chunk;
+        memcpy(out + len + 2, data + i, chunk);
+        len += 2 + chunk;
+    }
+
+    fcsStore(NEG_CHECK, fcsUpdate(NEG_CHECK, fcsInit(NEG_CHECK), out, len), out + len);
+    return len + fcsSize(NEG_CHECK);
+}
+
+int paramsDecode(link_params *p, const unsigned char *in, int len) {
+    if (len < fcsSize(NEG_CHECK) || !fcsCheck(NEG_CHECK, fcsUpdate(NEG_CHECK, fcsInit(NEG_CHECK), in, len)))
+        return -1;
+
+    link_params res = *p;
+    int end = len - fcsSize(NEG_CHECK);
+    int i = 0;
+
+    while (i < end) {
+        if (i + 2 > end || i + 2 + in[i + 1] > end)
+            return -1;
+
+        int type = in[i], size = in[i + 1];
+        unsigned int value = 0;
+        for (int k = 0; k < size && k < 4; k++)
+            value = value << 8 | in[i + 2 + k];
+        i += 2 + size;
+
+        switch (type) {
+            case NEG_ARQ: res.arq = value; break;
+            case NEG_SEQ_BITS: res.seq_bits = value; break;
+            case NEG_WINDOW: res.window = value; break;
+            case NEG_MAX_PAYLOAD: res.max_payload = value; break;
+            case NEG_FCS: res.fcs = value; break;
+            case NEG_FEC: res.fec = value; break;
+            case NEG_COMPRESSION: res.compression = value; break;
+            case NEG_FRAMING: res.framing = value; break;
+            case NEG_SCRAMBLING: res.scrambling = value; break;
+            case NEG_BATCHING: res.batching = value; break;
+            case NEG_HANDSHAKE_DATA: res.handshake_data = value; break;
+            case NEG_KEEPALIVE: res.keepalive = value; break;
+            default: break;
+        }
+    }
+
+    if (res.seq_bits < 1 || res.seq_bits > MAX_SEQ_BITS || res.window < 1 || res.max_payload < 1)
+        return -1;
+
+    *p = res;
+    return 0;
+}
+
+int paramsData(const unsigned char *in, int len, unsigned char *out) {
+    if (len < fcsSize(NEG_CHECK) || !fcsCheck(NEG_CHECK, fcsUpdate(NEG_CHECK, fcsInit(NEG_CHECK), in, len)))
+        return -1;
+
+    int end = len - fcsSize(NEG_CHECK);
+    int size = -1;
+
+    for (int i = 0; i < end; i += 2 + in[i + 1]) {
+        if (i + 2 > end || i + 2 + in[i + 1] > end)
+            return -1;
+        if (in[i] != NEG_DATA)
+            continue;
+
+        if (size < 0)
+            size = 0;
+        if (size + in[i + 1] > NEG_DATA_MAX)
+            return -1;
+        memcpy(out + size, in + i + 2, in[i + 1]);
+        size += in[i + 1];
+    }
+
+    return size;
+}
+
+int paramsAgree(const link_params *local, const link_params *peer, link_params *agreed) {
+    agreed->arq = highestBit(local->arq & peer->arq);
+    agreed->fcs = highestBit(local->fcs & peer->fcs);
+    agreed->fec = lowestBit(local->fec & peer->fec);
+    agreed->compression = highestBit(local->compression & peer->compression);
+    agreed->framing = highestBit(local->framing & peer->framing);
+    agreed->scrambling = highestBit(local->scrambling & peer->scrambling);
+    agreed->batching = highestBit(local->batching & peer->batching);
+    agreed->handshake_data = highestBit(local->handshake_data & peer->handshake_data);
+    agreed->keepalive = highestBit(local->keepalive & peer->keepalive);
+    agreed->seq_bits = smallest(local->seq_bits, peer->seq_bits);
+    agreed->window = smallest(local->window, peer->window);
+    agreed->max_payload = smallest(local->max_payload, peer->max_payload);
+
+    if (!agreed->arq || !agreed->fcs || !agreed->fec || !agreed->compression || !agreed->framing
+        || !agreed->scrambling || !agreed->batching || !agreed->handshake_data
+        || !agreed->keepalive)
+        return -1;
+    return 0;
+}
+
+int paramsValue(unsigned int mask) {
+    int value = 0;
+    while (mask > 1) {
+        mask >>= 1;
+        value++;
+    }
+    return value;
+}
@@ -0,0 +1,71 @@
+// Packet ring implementation
+
+#include "packet_ring.h"
+
+#include <stdlib.h>
+
+
+int ringInit(packet_ring *r, int slots, int slot_size) {
+    int n = 1;
+    while (n < slots)
+        n <<= 1;
+
+    r->data = malloc((size_t) n * slot_size);
+    r->sizes = malloc(n * sizeof(int));
+    if (r->data == NULL || r->sizes == NULL) {
+        ringFree(r);
+        return -1;
+    }
+
+    r->slots = n;
+    r->slot_size = slot_size;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    return 0;
+}
+
+void ringFree(packet_ring *r) {
+    free(r->data);
+    free(r->sizes);
+    r->data = NULL;
+    r->sizes = NULL;
+}
+
+int ringCount(packet_ring *r) {
+    unsigned int tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    unsigned int head = atomic_load_explicit(&r->head, memory_order_acquire);
+    return tail - head;
+}
+
+unsigned char *ringSlot(packet_ring *r) {
+    unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+    if (tail - head == (unsigned int) r->slots)
+        return NULL;
+    return r->data + (size_t) (tail & (r->slots - 1)) * r->slot_size;
+}
+
+void ringPush(packet_ring *r, int size) {
+    unsigned int tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+
+    r->sizes[tail & (r->slots - 1)] = size;
+    atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+const unsigned char *ringFront(packet_ring *r, int *size) {
+    unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    if (head == tail)
+        return NULL;
+
+    unsigned int slot = head & (r->slots - 1);
+    *size = r->sizes[slot];
+    return r->data + (size_t) slot * r->slot_size;
+}
+
+void ringPop(packet_ring *r) {
+    unsigned int head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+}
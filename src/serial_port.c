@@ -3,11 +3,14 @@
 
 #include "serial_port.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <termios.h>
 #include <unistd.h>
 
@@ -17,6 +20,15 @@
 int fd = -1; // File descriptor for open serial port
 struct termios oldtio; // Serial port settings to restore on closing
 
+// Receive buffer
+#define RX_BUF_SIZE 4096
+unsigned char rx_buf[RX_BUF_SIZE];
+int rx_head = 0;    // Next byte to hand out
+int rx_tail = 0;    // End of the buffered bytes
+unsigned long rx_calls = 0;
+unsigned long rx_filled = 0;
+unsigned long rx_bytes = 0;
+
 // Open and configure the serial port.
 // Returns -1 on error.
 int openSerialPort(const char *serialPort, int baudRate)
@@ -97,6 +109,9 @@ int openSerialPort(const char *serialPort, int baudRate)
 // Returns -1 on error.
 int closeSerialPort(void)
 {
+    // Drop anything left in the receive buffer
+    rx_head = rx_tail = 0;
+
     // Restore the old port settings
     if (tcsetattr(fd, TCSANOW, &oldtio) == -1)
     {
@@ -117,6 +132,101 @@ int readByte(char *byte)
 }
 
 
+// Get the buffered bytes, refilling the buffer from the serial port if it is
+// empty. *span points to the bytes until consumeBuffered() is called.
+// Returns -1 on error, otherwise the number of bytes available at *span.
+int readBuffered(const unsigned char **span)
+{
+    if (rx_head == rx_tail)
+    {
+        int res = read(fd, rx_buf, RX_BUF_SIZE);
+        rx_calls++;
+        rx_head = rx_tail = 0;
+        if (res < 0)
+            return -1;
+        rx_tail = res;
+        rx_bytes += res;
+        if (res > 0)
+            rx_filled++;
+    }
+
+    *span = &rx_buf[rx_head];
+    return rx_tail - rx_head;
+}
+
+
+// Drop the first n bytes returned by readBuffered().
+void consumeBuffered(int n)
+{
+    rx_head += n;
+}
+
+
+// Number of received bytes waiting in the buffer, read() not called.
+int bufferedBytes()
+{
+    return rx_tail - rx_head;
+}
+
+
+// Same as readByte(), served from the receive buffer.
+// Returns -1 on error, 0 if no byte was received, 1 if a byte was received.
+int readBufferedByte(char *byte)
+{
+    const unsigned char *span;
+    int n = readBuffered(&span);
+    if (n <= 0)
+        return n;
+
+    *byte = span[0];
+    rx_head++;
+    return 1;
+}
+
+
+// Number of read() calls made for the receive buffer, how many of them
+// returned data and the total number of bytes they returned.
+void serialReadStats(unsigned long *calls, unsigned long *filled, unsigned long *bytes)
+{
+    *calls = rx_calls;
+    *filled = rx_filled;
+    *bytes = rx_bytes;
+}
+
+
+// Sleep in poll() until the serial port has bytes to read or, if eventFd is
+// not -1, until eventFd becomes readable. timeoutMs < 0 waits forever.
+// Returns -1 on error, 0 on timeout, otherwise PORT_READABLE | EVENT_READABLE flags.
+int waitReadable(int eventFd, int timeoutMs)
+{
+    // Bytes left in the buffer need no system call
+    if (rx_head < rx_tail)
+        return PORT_READABLE;
+
+    struct pollfd fds[2] = {
+        {.fd = fd, .events = POLLIN},
+        {.fd = eventFd, .events = POLLIN},
+    };
+    int nfds = eventFd >= 0 ? 2 : 1;
+
+    int res;
+    do
+    {
+        res = poll(fds, nfds, timeoutMs);
+    } while (res < 0 && errno == EINTR);
+
+    if (res <= 0)
+        return res;
+
+    int ready = 0;
+    if (fds[0].revents)
+        ready |= PORT_READABLE;
+    if (nfds == 2 && fds[1].revents)
+        ready |= EVENT_READABLE;
+    return ready;
+}
+
+
 // Write up to numBytes to the serial port (must check how many were actually
 // written in the return value).
 // Returns -1 on error, otherwise the number of bytes written.
@@ -124,3 +234,8 @@ int writeBytes(const char *bytes, int numBytes)
 {
     return write(fd, bytes, numBytes);
 }
+
+int writeVector(const struct iovec *iov, int iovcnt)
+{
+    return writev(fd, iov, iovcnt);
+}
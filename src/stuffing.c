@@ -0,0 +1,425 @@
+// Byte stuffing engine implementation
+
+#include "stuffing.h"
+#include "fcs.h"
+
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#define STUFF_FLAG 0x7E
+#define STUFF_ESC 0x7D
+#define STUFF_XOR 0x20
+
+typedef int (*stuff_kernel)(unsigned char *, const unsigned char *, int, unsigned char *);
+
+static stuff_kernel kernel = NULL;
+static const char *kernel_name = "scalar";
+
+// Throughput accounting, only built with LINK_PROFILE: timing every call
+// costs two clock reads on the hot path
+static unsigned long long stuffed_bytes = 0;
+static unsigned long long stuffing_ns = 0;
+
+
+// Reference kernel, one byte at a time
+static int stuffScalar(unsigned char *out, const unsigned char *data, int len, unsigned char *bcc) {
+    int o = 0;
+    unsigned char x = 0;
+
+    for (int i = 0; i < len; i++) {
+        unsigned char b = data[i];
+
+        if (b == STUFF_FLAG || b == STUFF_ESC) {
+            out[o++] = STUFF_ESC;
+            out[o++] = b ^ STUFF_XOR;
+        } else {
+            out[o++] = b;
+        }
+        x ^= b;
+    }
+
+    *bcc ^= x;
+    return o;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// Copy a block whose bytes to escape are given by mask, one bit per byte
+static inline int escapeBlock(unsigned char *out, const unsigned char *block, int width, unsigned int mask) {
+    int o = 0;
+    int start = 0;
+
+    while (mask) {
+        int k = __builtin_ctz(mask);
+
+        memcpy(out + o, block + start, k - start);
+        o += k - start;
+        out[o++] = STUFF_ESC;
+        out[o++] = block[k] ^ STUFF_XOR;
+
+        start = k + 1;
+        mask &= mask - 1;
+    }
+
+    memcpy(out + o, block + start, width - start);
+    return o + width - start;
+}
+
+__attribute__((target("sse2")))
+static int stuffSSE2(unsigned char *out, const unsigned char *data, int len, unsigned char *bcc) {
+    const __m128i flag = _mm_set1_epi8(STUFF_FLAG);
+    const __m128i esc = _mm_set1_epi8(STUFF_ESC);
+    __m128i acc = _mm_setzero_si128();
+    int o = 0;
+    int i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (data + i));
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, flag), _mm_cmpeq_epi8(v, esc));
+        unsigned int mask = _mm_movemask_epi8(hit);
+
+        acc = _mm_xor_si128(acc, v);
+
+        if (mask == 0) {
+            // Clean block, copied as is
+            _mm_storeu_si128((__m128i *) (out + o), v);
+            o += 16;
+        } else {
+            o += escapeBlock(out + o, data + i, 16, mask);
+        }
+    }
+
+    unsigned char lanes[16];
+    unsigned char x = 0;
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    for (int k = 0; k < 16; k++)
+        x ^= lanes[k];
+    *bcc ^= x;
+
+    return o + stuffScalar(out + o, data + i, len - i, bcc);
+}
+
+__attribute__((target("avx2")))
+static int stuffAVX2(unsigned char *out, const unsigned char *data, int len, unsigned char *bcc) {
+    const __m256i flag = _mm256_set1_epi8(STUFF_FLAG);
+    const __m256i esc = _mm256_set1_epi8(STUFF_ESC);
+    __m256i acc = _mm256_setzero_si256();
+    int o = 0;
+    int i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (data + i));
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, flag), _mm256_cmpeq_epi8(v, esc));
+        unsigned int mask = _mm256_movemask_epi8(hit);
+
+        acc = _mm256_xor_si256(acc, v);
+
+        if (mask == 0) {
+            // Clean block, copied as is
+            _mm256_storeu_si256((__m256i *) (out + o), v);
+            o += 32;
+        } else {
+            o += escapeBlock(out + o, data + i, 32, mask);
+        }
+    }
+
+    unsigned char lanes[32];
+    unsigned char x = 0;
+    _mm256_storeu_si256((__m256i *) lanes, acc);
+    for (int k = 0; k < 32; k++)
+        x ^= lanes[k];
+    *bcc ^= x;
+
+    // Remaining bytes go through the 16-byte kernel
+    return o + stuffSSE2(out + o, data + i, len - i, bcc);
+}
+
+#endif // HAVE_X86_KERNELS
+
+// Pick the widest kernel the CPU supports
+static void selectKernel() {
+    kernel = stuffScalar;
+    kernel_name = "scalar";
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = stuffAVX2;
+        kernel_name = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        kernel = stuffSSE2;
+        kernel_name = "sse2";
+    }
+#endif
+}
+
+
+int stuffBytes(unsigned char *out, const unsigned char *data, int len, unsigned char *bcc) {
+    if (kernel == NULL)
+        selectKernel();
+
+#ifdef LINK_PROFILE
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int o = kernel(out, data, len, bcc);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    stuffed_bytes += len;
+    stuffing_ns += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+
+    return o;
+#else
+    return kernel(out, data, len, bcc);
+#endif
+}
+
+// Index of the first FLAG or ESC in p, or len if there is none
+static int findSpecial(const unsigned char *p, int len) {
+    int i = 0;
+
+#ifdef HAVE_X86_KERNELS
+    const __m128i flag = _mm_set1_epi8(STUFF_FLAG);
+    const __m128i esc = _mm_set1_epi8(STUFF_ESC);
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (p + i));
+        unsigned int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, flag), _mm_cmpeq_epi8(v, esc)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; i < len; i++)
+        if (p[i] == STUFF_FLAG || p[i] == STUFF_ESC)
+            return i;
+    return len;
+}
+
+unsigned char scrambleMask(const unsigned char *data, int len, int *plain, int *masked) {
+    unsigned int hist[256] = {0};
+
+    for (int i = 0; i < len; i++)
+        hist[data[i]]++;
+
+    // b ^ m is FLAG or ESC exactly when b is FLAG ^ m or ESC ^ m
+    int best = 0;
+    unsigned int best_cost = hist[STUFF_FLAG] + hist[STUFF_ESC];
+    *plain = best_cost;
+
+    for (int m = 1; m < 256 && best_cost > 0; m++) {
+        unsigned int cost = hist[STUFF_FLAG ^ m] + hist[STUFF_ESC ^ m] + (m == STUFF_FLAG || m == STUFF_ESC);
+        if (cost < best_cost) {
+            best = m;
+            best_cost = cost;
+        }
+    }
+
+    *masked = best_cost;
+    return best;
+}
+
+void scrambleBytes(unsigned char *out, const unsigned char *data, int len, unsigned char mask) {
+    for (int i = 0; i < len; i++)
+        out[i] = data[i] ^ mask;
+}
+
+// Escape sequences stuffVector() points at instead of copying
+static const unsigned char escaped_flag[2] = {STUFF_ESC, STUFF_FLAG ^ STUFF_XOR};
+static const unsigned char escaped_esc[2] = {STUFF_ESC, STUFF_ESC ^ STUFF_XOR};
+
+int stuffVector(struct iovec *iov, const unsigned char *data, int len) {
+    int n = 0;
+    int i = 0;
+
+    while (i < len) {
+        int run = findSpecial(data + i, len - i);
+        if (run > 0) {
+            iov[n].iov_base = (void *) (data + i);
+            iov[n++].iov_len = run;
+            i += run;
+        }
+
+        if (i < len) {
+            iov[n].iov_base = (void *) (data[i] == STUFF_FLAG ? escaped_flag : escaped_esc);
+            iov[n++].iov_len = 2;
+            i++;
+        }
+    }
+
+    return n;
+}
+
+void cobsEncodeInit(cobs_encoder *e, unsigned char *out) {
+    e->out = out;
+    e->code_at = 0;
+    e->size = 1;
+    e->code = 1;
+}
+
+void cobsEncodeUpdate(cobs_encoder *e, const unsigned char *data, int len) {
+    unsigned char *out = e->out;
+    int o = e->size, code_at = e->code_at, code = e->code;
+
+#ifdef LINK_PROFILE
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
+    for (int i = 0; i < len; i++) {
+        unsigned char b = data[i];
+
+        if (b != 0) {
+            out[o++] = b ^ STUFF_FLAG;
+            if (++code < 0xFF)
+                continue;
+        }
+
+        // A zero, or a full run with no zero after it
+        out[code_at] = code ^ STUFF_FLAG;
+        code_at = o++;
+        code = 1;
+    }
+
+    e->size = o;
+    e->code_at = code_at;
+    e->code = code;
+
+#ifdef LINK_PROFILE
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stuffed_bytes += len;
+    stuffing_ns += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+#endif
+}
+
+int cobsEncodeFinal(cobs_encoder *e) {
+    e->out[e->code_at] = e->code ^ STUFF_FLAG;
+    return e->size;
+}
+
+void destuffInit(destuffer *d, unsigned char *out, int capacity, int fcs, int framing) {
+    d->out = out;
+    d->capacity = capacity;
+    d->size = 0;
+    d->escape = 0;
+    d->framing = framing;
+    d->code = 0;
+    d->left = 0;
+    d->fcs = fcs;
+    d->check = fcsInit(fcs);
+}
+
+static int decodeCobs(destuffer *d, const unsigned char *in, int len, destuff_status *status) {
+    int i = 0;
+
+    while (i < len) {
+        if (d->left == 0) {
+            if (in[i] == STUFF_FLAG) {
+                *status = DESTUFF_FRAME_END;
+                return i + 1;
+            }
+
+            // Code byte: the run before it ended with a zero unless it was full
+            if (d->code != 0 && d->code < 0xFF) {
+                if (d->size >= d->capacity) {
+                    *status = DESTUFF_OVERFLOW;
+                    return i;
+                }
+                unsigned char zero = 0;
+                d->out[d->size++] = zero;
+                d->check = fcsUpdate(d->fcs, d->check, &zero, 1);
+            }
+            d->code = in[i++] ^ STUFF_FLAG;
+            d->left = d->code - 1;
+            continue;
+        }
+
+        int run = d->left < len - i ? d->left : len - i;
+        const unsigned char *flag = memchr(in + i, STUFF_FLAG, run);
+        if (flag != NULL)
+            run = flag - (in + i);
+        if (run > d->capacity - d->size) {
+            *status = DESTUFF_OVERFLOW;
+            return i;
+        }
+
+        unsigned char *out = d->out + d->size;
+        for (int k = 0; k < run; k++)
+            out[k] = in[i + k] ^ STUFF_FLAG;
+        d->check = fcsUpdate(d->fcs, d->check, out, run);
+        d->size += run;
+        d->left -= run;
+        i += run;
+
+        if (flag != NULL) {
+            // The frame ended inside a run: bytes were lost
+            d->size = 0;
+            *status = DESTUFF_FRAME_END;
+            return i + 1;
+        }
+    }
+
+    *status = DESTUFF_MORE;
+    return i;
+}
+
+int destuffBytes(destuffer *d, const unsigned char *in, int len, destuff_status *status) {
+    int i = 0;
+
+    if (d->framing == FRAMING_COBS)
+        return decodeCobs(d, in, len, status);
+
+    while (i < len) {
+        if (in[i] == STUFF_FLAG) {
+            *status = DESTUFF_FRAME_END;
+            return i + 1;
+        }
+
+        if (d->escape) {
+            if (d->size >= d->capacity) {
+                *status = DESTUFF_OVERFLOW;
+                return i;
+            }
+            unsigned char b = in[i++] ^ STUFF_XOR;
+            d->out[d->size++] = b;
+            d->check = fcsUpdate(d->fcs, d->check, &b, 1);
+            d->escape = 0;
+            continue;
+        }
+
+        // Copy the run of bytes that need no destuffing in one go
+        int run = findSpecial(in + i, len - i);
+        if (run > d->capacity - d->size) {
+            *status = DESTUFF_OVERFLOW;
+            return i;
+        }
+        memcpy(d->out + d->size, in + i, run);
+        d->check = fcsUpdate(d->fcs, d->check, in + i, run);
+        d->size += run;
+        i += run;
+
+        if (i < len && in[i] == STUFF_ESC) {
+            d->escape = 1;
+            i++;
+        }
+    }
+
+    *status = DESTUFF_MORE;
+    return i;
+}
+
+const char *stuffingEngine() {
+    if (kernel == NULL)
+        selectKernel();
+    return kernel_name;
+}
+
+double stuffingThroughput() {
+    if (stuffing_ns == 0)
+        return 0;
+    return stuffed_bytes * 1e9 / stuffing_ns;
+}
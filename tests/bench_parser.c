@@ -0,0 +1,163 @@
+// Frame parser benchmark: feeds a frame stream to parseFrame() over and
+// over and reports frames/s, without the per-call timing of LINK_PROFILE.
+//
+// Usage: bench_parser [capture [escape|cobs]]
+// capture holds raw bytes recorded from the line. Without one, a stream of
+// 1000-byte I-frames, each followed by a RR, is built for both framings.
+
+#include "frame_parser.h"
+#include "stuffing.h"
+#include "fcs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define A_TX 0x03
+#define A_RX 0x01
+#define I_EXT 0x40
+#define RR_EXT 0x30
+#define MODULO 128
+#define FCS FCS_CRC32C
+#define PAYLOAD 1000
+#define FRAMES 1000
+#define MAX_FIELD 8192
+#define BENCH_NS 1000000000LL   /* Run each stream for about a second */
+
+static long long nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Parser set up like the link layer's for the windowed ARQ modes
+static void setupParser(frame_parser *p) {
+    parserInit(p, MODULO, FCS);
+    p->address[A_TX] = 1;
+    p->address[A_RX] = 1;
+    for (int c = I_EXT; c < I_EXT + 0x40; c += 0x10)
+        p->control[c] = CTRL_CLASS_PAIR | CTRL_CLASS_DATA;
+    for (int c = RR_EXT; c <= RR_EXT + 2; c++)
+        p->control[c] = CTRL_CLASS_LONG;
+}
+
+// FLAG and the stuffed header octets
+static int header(unsigned char *out, const unsigned char *octets, int len) {
+    unsigned char bcc = 0;
+    out[0] = 0x7E;
+    return 1 + stuffBytes(out + 1, octets, len, &bcc);
+}
+
+// Build FRAMES I-frames with random payloads, each followed by a RR
+static unsigned char *buildStream(int framing, int *size) {
+    unsigned char *stream = malloc((size_t) FRAMES * (2 * (PAYLOAD + FCS_MAX_SIZE) + 32));
+    unsigned char payload[PAYLOAD + FCS_MAX_SIZE];
+    int s = 0;
+
+    for (int k = 0; k < FRAMES; k++) {
+        int ns = k % MODULO;
+        unsigned char i_hdr[5] = {A_TX, I_EXT, ns, 0, A_TX ^ I_EXT ^ ns};
+        s += header(stream + s, i_hdr, 5);
+
+        for (int i = 0; i < PAYLOAD; i++)
+            payload[i] = rand();
+        fcsStore(FCS, fcsUpdate(FCS, fcsInit(FCS), payload, PAYLOAD), payload + PAYLOAD);
+        int field = PAYLOAD + fcsSize(FCS);
+
+        if (framing == FRAMING_COBS) {
+            cobs_encoder e;
+            cobsEncodeInit(&e, stream + s);
+            cobsEncodeUpdate(&e, payload, field);
+            s += cobsEncodeFinal(&e);
+        } else {
+            unsigned char bcc = 0;
+            s += stuffBytes(stream + s, payload, field, &bcc);
+        }
+        stream[s++] = 0x7E;
+
+        int nr = (ns + 1) % MODULO;
+        unsigned char rr[4] = {A_TX, RR_EXT, nr, A_TX ^ RR_EXT ^ nr};
+        s += header(stream + s, rr, 4);
+        stream[s++] = 0x7E;
+    }
+
+    *size = s;
+    return stream;
+}
+
+// Parse the whole stream once, in chunks as read() would return them.
+// Returns the number of complete frames.
+static unsigned long parseStream(frame_parser *p, const unsigned char *stream, int size, int framing,
+                                 unsigned char *field) {
+    const int chunk = 4096;
+    unsigned long frames = 0;
+
+    for (int off = 0; off < size;) {
+        int len = size - off < chunk ? size - off : chunk;
+        parse_status status;
+
+        off += parseFrame(p, stream + off, len, &status);
+        if (status == PARSE_HEADER)
+            parserReceive(p, field, MAX_FIELD, framing);
+        else if (status == PARSE_FRAME)
+            frames++;
+    }
+
+    return frames;
+}
+
+static void bench(const char *name, const unsigned char *stream, int size, int framing) {
+    static unsigned char field[MAX_FIELD];
+    frame_parser p;
+    unsigned long frames = 0;
+    long long bytes = 0;
+
+    setupParser(&p);
+    long long start = nowNs(), elapsed;
+    do {
+        frames += parseStream(&p, stream, size, framing, field);
+        bytes += size;
+        elapsed = nowNs() - start;
+    } while (elapsed < BENCH_NS);
+
+    printf("%-8s %10.0f frames/s  %8.1f MB/s  (%lu frames, %lu header errors, %lu resyncs)\n", name,
+           frames * 1e9 / elapsed, bytes * 1e3 / elapsed, frames, p.header_errors, p.resyncs);
+}
+
+int main(int argc, char *argv[]) {
+    printf("Stuffing engine: %s, frame check: %s\n", stuffingEngine(), fcsEngine(FCS));
+
+    if (argc > 1) {
+        FILE *f = fopen(argv[1], "rb");
+        if (f == NULL) {
+            perror(argv[1]);
+            return 1;
+        }
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        rewind(f);
+
+        unsigned char *stream = malloc(size > 0 ? size : 1);
+        if (fread(stream, 1, size, f) != (size_t) size) {
+            perror(argv[1]);
+            return 1;
+        }
+        fclose(f);
+
+        int framing = argc > 2 && strcmp(argv[2], "cobs") == 0 ? FRAMING_COBS : FRAMING_ESCAPE;
+        bench(framing == FRAMING_COBS ? "cobs" : "escape", stream, size, framing);
+        free(stream);
+        return 0;
+    }
+
+    srand(1);
+    for (int framing = FRAMING_ESCAPE; framing <= FRAMING_COBS; framing++) {
+        int size;
+        unsigned char *stream = buildStream(framing, &size);
+        bench(framing == FRAMING_COBS ? "cobs" : "escape", stream, size, framing);
+        free(stream);
+    }
+
+    return 0;
+}
@@ -0,0 +1,128 @@
+// Byte stuffing benchmark: runs every stuffing kernel the CPU has, the
+// COBS encoder and the destuffer over 1000-byte payloads and reports
+// MB/s, without the per-call timing of LINK_PROFILE.
+//
+// Usage: bench_stuffing
+
+#include "../src/stuffing.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define PAYLOAD 1000
+#define PAYLOADS 1000
+#define BENCH_NS 500000000LL    /* Run each engine for about half a second */
+
+static long long nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned char data[PAYLOADS][PAYLOAD];
+static unsigned char out[2 * PAYLOAD + 2];
+static unsigned char stuffed[PAYLOADS][2 * PAYLOAD + 2];
+static int stuffed_size[PAYLOADS];
+
+// Random payloads, with one byte in escape_every a FLAG or ESC
+static void fill(int escape_every) {
+    for (int k = 0; k < PAYLOADS; k++)
+        for (int i = 0; i < PAYLOAD; i++)
+            data[k][i] = rand() % escape_every == 0 ? STUFF_FLAG - rand() % 2 : rand();
+}
+
+static void report(const char *engine, const char *input, long long bytes, long long elapsed) {
+    printf("%-14s %-8s %8.1f MB/s\n", engine, input, bytes * 1e3 / elapsed);
+}
+
+// Stuff every payload with kernel k until BENCH_NS elapsed
+static void benchKernel(stuff_kernel k, const char *engine, const char *input) {
+    long long bytes = 0, start = nowNs(), elapsed;
+    unsigned char bcc = 0;
+
+    do {
+        for (int p = 0; p < PAYLOADS; p++)
+            k(out, data[p], PAYLOAD, &bcc);
+        bytes += (long long) PAYLOADS * PAYLOAD;
+        elapsed = nowNs() - start;
+    } while (elapsed < BENCH_NS);
+
+    report(engine, input, bytes, elapsed);
+}
+
+static void benchCobsEncode(const char *input) {
+    long long bytes = 0, start = nowNs(), elapsed;
+    cobs_encoder e;
+
+    do {
+        for (int p = 0; p < PAYLOADS; p++) {
+            cobsEncodeInit(&e, out);
+            cobsEncodeUpdate(&e, data[p], PAYLOAD);
+            cobsEncodeFinal(&e);
+        }
+        bytes += (long long) PAYLOADS * PAYLOAD;
+        elapsed = nowNs() - start;
+    } while (elapsed < BENCH_NS);
+
+    report("cobs", input, bytes, elapsed);
+}
+
+// Destuff payloads stuffed beforehand with the given framing
+static void benchDestuff(int framing, const char *engine, const char *input) {
+    static unsigned char payload[PAYLOAD + 1];
+    long long bytes = 0, start, elapsed;
+    destuffer d;
+    destuff_status status;
+
+    for (int p = 0; p < PAYLOADS; p++) {
+        unsigned char bcc = 0;
+        if (framing == FRAMING_COBS) {
+            cobs_encoder e;
+            cobsEncodeInit(&e, stuffed[p]);
+            cobsEncodeUpdate(&e, data[p], PAYLOAD);
+            stuffed_size[p] = cobsEncodeFinal(&e);
+        } else
+            stuffed_size[p] = stuffBytes(stuffed[p], data[p], PAYLOAD, &bcc);
+        stuffed[p][stuffed_size[p]++] = STUFF_FLAG;
+    }
+
+    start = nowNs();
+    do {
+        for (int p = 0; p < PAYLOADS; p++) {
+            destuffInit(&d, payload, sizeof(payload), FCS_XOR, framing);
+            destuffBytes(&d, stuffed[p], stuffed_size[p], &status);
+        }
+        bytes += (long long) PAYLOADS * PAYLOAD;
+        elapsed = nowNs() - start;
+    } while (elapsed < BENCH_NS);
+
+    report(engine, input, bytes, elapsed);
+}
+
+int main() {
+    static const struct {
+        const char *name;
+        int escape_every;
+    } inputs[] = {{"random", 256}, {"escapes", 8}};
+
+    selectKernel();
+    printf("Stuffing engine: %s\n", kernel_name);
+
+    srand(1);
+    for (int i = 0; i < 2; i++) {
+        fill(inputs[i].escape_every);
+
+        benchKernel(stuffScalar, "scalar", inputs[i].name);
+#ifdef HAVE_X86_KERNELS
+        if (__builtin_cpu_supports("sse2"))
+            benchKernel(stuffSSE2, "sse2", inputs[i].name);
+        if (__builtin_cpu_supports("avx2"))
+            benchKernel(stuffAVX2, "avx2", inputs[i].name);
+#endif
+        benchCobsEncode(inputs[i].name);
+        benchDestuff(FRAMING_ESCAPE, "destuff-esc", inputs[i].name);
+        benchDestuff(FRAMING_COBS, "destuff-cobs", inputs[i].name);
+    }
+
+    return 0;
+}
@@ -0,0 +1,152 @@
+// Payload compression test: every block must come back intact and fit in
+// exactly the size compressBlock() reported, random data must not fit in
+// fewer bytes than it has, so the link layer sends it raw, repetitive data
+// must shrink, and matches must reach the largest offset and any length.
+
+#include "compress.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LEN 4096
+#define MAX_OFFSET 65535
+#define FAR_LEN 300                 /* Bytes repeated MAX_OFFSET bytes later */
+#define BLOCK_LEN (MAX_OFFSET + 1 + FAR_LEN)
+#define GUARD 16                    /* Bytes past the capacity that must stay untouched */
+
+static int failures = 0;
+
+static void fail(const char *what, const char *input, int len) {
+    printf("FAIL: %s, %s data, %d bytes\n", what, input, len);
+    failures++;
+}
+
+// Compress and decompress len bytes of data.
+// Returns the compressed size, or -1 after a failure.
+static int roundTrip(const unsigned char *data, int len, const char *input) {
+    static unsigned char packed[BLOCK_LEN + BLOCK_LEN / 255 + 16 + GUARD], out[BLOCK_LEN];
+    int capacity = sizeof(packed) - GUARD;
+
+    int size = compressBlock(data, len, packed, capacity);
+    if (size < 0) {
+        fail("compressBlock", input, len);
+        return -1;
+    }
+
+    // Exactly size bytes are enough, one less is not and nothing past them is written
+    memset(packed, 0xA5, sizeof(packed));
+    if (compressBlock(data, len, packed, size) != size)
+        fail("compressBlock in its own size", input, len);
+    if (size > 0 && compressBlock(data, len, packed, size - 1) != -1)
+        fail("compressBlock in one byte less", input, len);
+    for (int i = size; i < size + GUARD; i++) {
+        if (packed[i] != 0xA5) {
+            fail("compressBlock wrote past the capacity", input, len);
+            break;
+        }
+    }
+
+    compressBlock(data, len, packed, capacity);
+    if (decompressBlock(packed, size, out, len) != len || memcmp(out, data, len) != 0) {
+        fail("decompressBlock", input, len);
+        return -1;
+    }
+    if (len > 0 && decompressBlock(packed, size, out, len - 1) != -1)
+        fail("decompressBlock in one byte less", input, len);
+    return size;
+}
+
+// Random data: the link layer asks for fewer bytes than the payload has and
+// must be refused, so the frame goes raw and never grows
+static void checkIncompressible(unsigned char *data) {
+    static unsigned char packed[MAX_LEN];
+
+    for (int len = 1; len <= MAX_LEN; len += 1 + len / 8) {
+        for (int i = 0; i < len; i++)
+            data[i] = rand();
+
+        if (compressBlock(data, len, packed, len - 1) != -1)
+            fail("no fallback to raw", "random", len);
+        roundTrip(data, len, "random");
+    }
+}
+
+// Runs and short periods shrink to a handful of bytes per 255 of them
+static void checkRepetitive(unsigned char *data) {
+    static const int periods[] = {1, 2, 3, 4, 7, 64, 255, 1000};
+
+    for (int p = 0; p < (int) (sizeof(periods) / sizeof(periods[0])); p++) {
+        int period = periods[p];
+        for (int i = 0; i < MAX_LEN; i++)
+            data[i] = i < period ? rand() : data[i - period];
+
+        int size = roundTrip(data, MAX_LEN, "periodic");
+        if (size >= 0 && size > period + MAX_LEN / 64)
+            fail("periodic data did not shrink", "periodic", MAX_LEN);
+    }
+}
+
+// Literal and match lengths around every step of their encoding: the
+// nibble, then each extra byte
+static void checkLengths(unsigned char *data) {
+    static const int steps[] = {0, 1, 4, 14, 15, 16, 18, 19, 20, 268, 269, 270, 273, 274, 275, 524, 529, 530};
+    int n = sizeof(steps) / sizeof(steps[0]);
+
+    for (int a = 0; a < n; a++) {
+        for (int b = 0; b < n; b++) {
+            int lit = steps[a], run = steps[b];
+
+            // Literals, then a run the compressor takes as one match
+            for (int i = 0; i < lit; i++)
+                data[i] = rand() | 1;
+            memset(data + lit, 0, run);
+            roundTrip(data, lit + run, "literals and run");
+        }
+    }
+
+    // The longest match a payload can hold: all of it but one byte
+    memset(data, 0x7E, MAX_LEN);
+    int size = roundTrip(data, MAX_LEN, "one byte");
+    if (size >= 0 && size > 32)
+        fail("longest match not taken", "one byte", MAX_LEN);
+}
+
+// The same bytes MAX_OFFSET bytes apart are matched, one byte further they
+// cannot be. Zeros in between keep the hash table clear of other entries.
+static void checkOffsets(unsigned char *data) {
+    for (int gap = MAX_OFFSET; gap <= MAX_OFFSET + 1; gap++) {
+        int len = gap + FAR_LEN;
+
+        for (int i = 0; i < FAR_LEN; i++)
+            data[i] = rand() | 1;
+        memset(data + FAR_LEN, 0, gap - FAR_LEN);
+        memcpy(data + gap, data, FAR_LEN);
+
+        int size = roundTrip(data, len, gap == MAX_OFFSET ? "largest offset" : "past largest offset");
+        if (size < 0)
+            continue;
+        if (gap == MAX_OFFSET && size >= 2 * FAR_LEN)
+            fail("match at the largest offset not taken", "largest offset", len);
+        if (gap > MAX_OFFSET && size < 2 * FAR_LEN)
+            fail("match past the largest offset taken", "past largest offset", len);
+    }
+}
+
+int main() {
+    static unsigned char data[BLOCK_LEN];
+
+    srand(1);
+    roundTrip(data, 0, "empty");
+    checkIncompressible(data);
+    checkRepetitive(data);
+    checkLengths(data);
+    checkOffsets(data);
+
+    if (failures > 0) {
+        printf("%d compression checks failed\n", failures);
+        return 1;
+    }
+    printf("All compression checks passed\n");
+    return 0;
+}
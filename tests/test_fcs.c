@@ -0,0 +1,138 @@
+// Frame check sequence test: every FCS must give the standard check value
+// over "123456789", slice-by-8 and SSE4.2 must match a bit-at-a-time
+// reference at every length and alignment, and a payload followed by its
+// FCS must check while a damaged one must not.
+
+#include "../src/fcs.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_LEN 2100
+#define ROUNDS 2000
+
+static int failures = 0;
+
+static const char *fcsName(int type) {
+    static const char *names[] = {"xor", "crc16", "crc32", "crc32c"};
+    return names[type];
+}
+
+static void fail(const char *what, int type, int len, int align) {
+    printf("FAIL: %s, %s, %d bytes at offset %d\n", what, fcsName(type), len, align);
+    failures++;
+}
+
+// Reference: one bit at a time, straight from the polynomial
+static uint32_t crcBitwise(uint32_t poly, uint32_t crc, const unsigned char *p, int len) {
+    for (int i = 0; i < len; i++) {
+        crc ^= p[i];
+        for (int k = 0; k < 8; k++)
+            crc = (crc & 1) ? (crc >> 1) ^ poly : crc >> 1;
+    }
+    return crc;
+}
+
+static uint32_t reference(int type, uint32_t state, const unsigned char *p, int len) {
+    switch (type) {
+        case FCS_CRC16: return crcBitwise(CRC16_POLY, state, p, len);
+        case FCS_CRC32: return crcBitwise(CRC32_POLY, state, p, len);
+        case FCS_CRC32C: return crcBitwise(CRC32C_POLY, state, p, len);
+        default:
+            for (int i = 0; i < len; i++)
+                state ^= p[i];
+            return state;
+    }
+}
+
+// Check values of the CRC catalogue: X-25, ISO-HDLC and ISCSI
+static void checkValues() {
+    static const unsigned int check[] = {0x31, 0x906E, 0xCBF43926, 0xE3069283};
+    const unsigned char *digits = (const unsigned char *) "123456789";
+
+    for (int type = FCS_XOR; type <= FCS_CRC32C; type++) {
+        unsigned char fcs[FCS_MAX_SIZE];
+        unsigned int value = 0;
+
+        fcsStore(type, fcsUpdate(type, fcsInit(type), digits, 9), fcs);
+        for (int i = fcsSize(type) - 1; i >= 0; i--)
+            value = value << 8 | fcs[i];
+        if (value != check[type])
+            fail("check value", type, 9, 0);
+    }
+}
+
+// Every implementation against the reference, in one piece and split
+static void compareEngines(const unsigned char *data, int len, int align) {
+    const unsigned char *p = data + align;
+    int split = len > 0 ? rand() % (len + 1) : 0;
+
+    for (int type = FCS_XOR; type <= FCS_CRC32C; type++) {
+        uint32_t expected = reference(type, fcsInit(type), p, len);
+
+        if (fcsUpdate(type, fcsInit(type), p, len) != expected)
+            fail("fcsUpdate", type, len, align);
+        uint32_t state = fcsUpdate(type, fcsInit(type), p, split);
+        if (fcsUpdate(type, state, p + split, len - split) != expected)
+            fail("fcsUpdate in two pieces", type, len, align);
+    }
+
+    if (crcSlice8(crc16_tables, 0xFFFF, p, len) != reference(FCS_CRC16, 0xFFFF, p, len))
+        fail("slice-by-8", FCS_CRC16, len, align);
+    if (crcSlice8(crc32_tables, 0xFFFFFFFF, p, len) != reference(FCS_CRC32, 0xFFFFFFFF, p, len))
+        fail("slice-by-8", FCS_CRC32, len, align);
+    if (crcSlice8(crc32c_tables, 0xFFFFFFFF, p, len) != reference(FCS_CRC32C, 0xFFFFFFFF, p, len))
+        fail("slice-by-8", FCS_CRC32C, len, align);
+#ifdef HAVE_X86_KERNELS
+    if (have_sse42 && crc32cHardware(0xFFFFFFFF, p, len) != reference(FCS_CRC32C, 0xFFFFFFFF, p, len))
+        fail("sse4.2", FCS_CRC32C, len, align);
+#endif
+}
+
+// A payload followed by its FCS checks, with one bit flipped it does not
+static void checkResidue(unsigned char *data, int len) {
+    for (int type = FCS_XOR; type <= FCS_CRC32C; type++) {
+        int size = len + fcsSize(type);
+
+        fcsStore(type, fcsUpdate(type, fcsInit(type), data, len), data + len);
+        if (!fcsCheck(type, fcsUpdate(type, fcsInit(type), data, size)))
+            fail("good frame rejected", type, len, 0);
+
+        int bit = rand() % (8 * size);
+        data[bit / 8] ^= 1 << (bit % 8);
+        if (fcsCheck(type, fcsUpdate(type, fcsInit(type), data, size)))
+            fail("damaged frame accepted", type, len, 0);
+        data[bit / 8] ^= 1 << (bit % 8);
+    }
+}
+
+int main() {
+    static unsigned char data[MAX_LEN + 8 + FCS_MAX_SIZE];
+
+    srand(1);
+    for (int i = 0; i < (int) sizeof(data); i++)
+        data[i] = rand();
+
+    initTables();
+    printf("Frame check engines: crc16 %s, crc32 %s, crc32c %s\n",
+           fcsEngine(FCS_CRC16), fcsEngine(FCS_CRC32), fcsEngine(FCS_CRC32C));
+
+    checkValues();
+
+    // Every short length at every alignment, then random ones
+    for (int len = 0; len <= 64; len++)
+        for (int align = 0; align < 8; align++)
+            compareEngines(data, len, align);
+    for (int i = 0; i < ROUNDS; i++)
+        compareEngines(data, rand() % (MAX_LEN + 1), rand() % 8);
+
+    for (int len = 1; len <= MAX_LEN; len += 1 + len / 4)
+        checkResidue(data, len);
+
+    if (failures > 0) {
+        printf("%d frame check tests failed\n", failures);
+        return 1;
+    }
+    printf("All frame check tests passed\n");
+    return 0;
+}
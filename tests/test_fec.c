@@ -0,0 +1,129 @@
+// Forward error correction test: RS(255,223) blocks of one codeword and of
+// several interleaved ones must come back intact with up to 16 damaged
+// bytes in every codeword, and a codeword with 17 must make the block fail.
+
+#include "fec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_LEN 4200
+#define ROUNDS 20
+
+static int failures = 0;
+
+static void fail(const char *what, int len, int errors) {
+    printf("FAIL: %s, %d data bytes, %d errors per codeword\n", what, len, errors);
+    failures++;
+}
+
+// Encode len bytes of data, fed in two pieces, with the parity after them.
+// Returns the size of the block.
+static int encode(unsigned char *block, const unsigned char *data, int len) {
+    fec_encoder e;
+    int split = rand() % (len + 1);
+
+    memcpy(block, data, len);
+    fecEncodeInit(&e, len, block + len);
+    fecEncodeUpdate(&e, data, split);
+    fecEncodeUpdate(&e, data + split, len - split);
+    return len + fecSize(FEC_RS, len);
+}
+
+// Offset in the block of byte i of codeword j, parity included
+static int codewordByte(int len, int j, int i) {
+    int m = (len + FEC_DATA - 1) / FEC_DATA;
+    int k = (len - j + m - 1) / m;     /* Data bytes in codeword j */
+
+    return i < k ? j + i * m : len + (i - k) * m + j;
+}
+
+// Damage errors distinct bytes of every codeword.
+// Returns how many of them are data bytes.
+static int damage(unsigned char *block, int len, int errors) {
+    int m = (len + FEC_DATA - 1) / FEC_DATA;
+    int in_data = 0;
+
+    for (int j = 0; j < m; j++) {
+        int n = (len - j + m - 1) / m + FEC_PARITY;
+        int picked[FEC_DATA + FEC_PARITY] = {0};
+
+        for (int e = 0; e < errors; e++) {
+            int i;
+            do
+                i = rand() % n;
+            while (picked[i]);
+            picked[i] = 1;
+
+            int at = codewordByte(len, j, i);
+            block[at] ^= 1 + rand() % 255;
+            in_data += at < len;
+        }
+    }
+    return in_data;
+}
+
+static void checkBlock(const unsigned char *data, int len, int errors) {
+    static unsigned char block[MAX_LEN + FEC_MAX_SIZE(MAX_LEN)];
+    int size = encode(block, data, len);
+    int in_data = damage(block, len, errors);
+    int decoded;
+
+    int res = fecDecode(FEC_RS, block, size, &decoded);
+    if (errors > FEC_PARITY / 2) {
+        if (res >= 0)
+            fail("too many errors corrected", len, errors);
+        return;
+    }
+
+    if (res != in_data)
+        fail("wrong number of corrected bytes", len, errors);
+    else if (decoded != len || memcmp(block, data, len) != 0)
+        fail("data not restored", len, errors);
+}
+
+// Interleaving: one burst as long as 16 bytes of every codeword. It stays
+// in the data, whose last row may be short: a burst running from it into
+// the parity hits the first codewords once more.
+static void checkBurst(const unsigned char *data, int len) {
+    static unsigned char block[MAX_LEN + FEC_MAX_SIZE(MAX_LEN)];
+    int size = encode(block, data, len);
+    int m = (len + FEC_DATA - 1) / FEC_DATA;
+    int burst = FEC_PARITY / 2 * m;
+    int start = m == 1 ? rand() % (size - burst + 1) : rand() % (len - burst + 1);
+    int decoded;
+
+    for (int i = start; i < start + burst; i++)
+        block[i] ^= 0xFF;
+
+    if (fecDecode(FEC_RS, block, size, &decoded) < 0 || decoded != len || memcmp(block, data, len) != 0)
+        fail("burst not corrected", len, FEC_PARITY / 2);
+}
+
+int main() {
+    // One codeword, up to a full one, then several interleaved ones
+    static const int lengths[] = {1, 17, 100, 222, 223, 224, 446, 447, 1000, 4100, MAX_LEN};
+    static unsigned char data[MAX_LEN];
+
+    srand(1);
+    for (int l = 0; l < (int) (sizeof(lengths) / sizeof(lengths[0])); l++) {
+        int len = lengths[l];
+
+        for (int round = 0; round < ROUNDS; round++) {
+            for (int i = 0; i < len; i++)
+                data[i] = rand();
+
+            for (int errors = 0; errors <= FEC_PARITY / 2 + 1; errors++)
+                checkBlock(data, len, errors);
+            checkBurst(data, len);
+        }
+    }
+
+    if (failures > 0) {
+        printf("%d FEC checks failed\n", failures);
+        return 1;
+    }
+    printf("All FEC checks passed\n");
+    return 0;
+}
@@ -0,0 +1,482 @@
+// Link test: a transmitter and a receiver, each in its own process, over a
+// pair of pseudo-terminals joined by a relay. Every case checks that the
+// packets come out of llread the same and in order. In the last ones the
+// other end runs the original protocol, which does not negotiate.
+
+#define _XOPEN_SOURCE 600
+
+#include "link_layer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#define PACKETS 200
+#define PER_CALL 8          /* Packets given to each llwritev */
+#define LONG_EVERY 25       /* Every so many packets one is too long to share a frame */
+#define LONG_SIZE 1500
+#define BAUD_RATE 115200
+#define RX_START_US 500000  /* Head start of the receiver */
+#define CASE_TIMEOUT_S 60   /* A case taking longer hung */
+
+#define RING_PACKETS 64     /* Four times the packets the receive ring holds */
+#define RING_SIZE 200
+#define SLOW_START_US 1000000   /* The receiver leaves the ring full this long */
+#define SLOW_READ_US 2000       /* Then takes each packet this late */
+
+#define LEGACY_PACKETS 40
+#define LEGACY_SIZE 1000        /* Longest packet of the original protocol */
+#define LEGACY_TRIES 4
+#define LEGACY_TIMEOUT_MS 3000  /* Of an original station waiting for a frame */
+
+// Frames of the original protocol
+#define FLAG 0x7E
+#define ESC 0x7D
+#define A_TX 0x03
+#define A_RX 0x01
+#define SET 0x03
+#define UA 0x07
+#define DISC 0x0B
+#define INF(n) ( (n) == 0 ? 0x00 : 0x80 )
+#define RR(n) ( (n) == 0 ? 0xAA : 0xAB )
+#define REJ(n) ( (n) == 0 ? 0x54 : 0x55 )
+
+// Size and contents of packet k, known to both ends
+static int packetSize(int k) {
+    return k % LONG_EVERY == LONG_EVERY - 1 ? LONG_SIZE : 1 + (k * 37) % 300;
+}
+
+static void fillPacket(unsigned char *packet, int k, int size) {
+    for (int j = 0; j < size; j++)
+        packet[j] = k * 7 + j;
+}
+
+// Packets of the original protocol cases: every size up to the longest
+static int legacySize(int k) {
+    return 1 + (k * 37) % LEGACY_SIZE;
+}
+
+// Pseudo-terminal master, its slave name in name. The slave is kept open
+// too, in slave, or the master would report a hangup until the link layer
+// opens it.
+static int openPty(char *name, int size, int *slave) {
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) < 0 || unlockpt(fd) < 0) {
+        perror("posix_openpt");
+        exit(1);
+    }
+    strncpy(name, ptsname(fd), size - 1);
+    *slave = open(name, O_RDWR | O_NOCTTY);
+    if (*slave < 0) {
+        perror(name);
+        exit(1);
+    }
+    return fd;
+}
+
+// Copy bytes between the two masters, as the cable would
+static void relay(int a, int b) {
+    struct pollfd fds[2] = {{.fd = a, .events = POLLIN}, {.fd = b, .events = POLLIN}};
+    unsigned char buf[4096];
+
+    while (poll(fds, 2, -1) >= 0) {
+        for (int i = 0; i < 2; i++) {
+            if (!(fds[i].revents & POLLIN))
+                continue;
+            int n = read(fds[i].fd, buf, sizeof(buf));
+            if (n > 0 && write(fds[1 - i].fd, buf, n) != n)
+                perror("write");
+        }
+    }
+}
+
+static LinkLayer params(const char *port, LinkLayerRole role) {
+    LinkLayer p = {.role = role, .baudRate = BAUD_RATE, .nRetransmissions = 3, .timeout = 1};
+    strncpy(p.serialPort, port, sizeof(p.serialPort) - 1);
+    return p;
+}
+
+// Read until the other end disconnects, checking count packets of the
+// given sizes (size_of(k), or fixed if it is NULL), waiting wait_us
+// before each read and first_us before the first one.
+// Returns the number of failures.
+static int readPackets(const char *port, int count, int (*size_of)(int), int fixed,
+                       int first_us, int wait_us) {
+    static unsigned char packet[MAX_PAYLOAD_SIZE], expected[MAX_PAYLOAD_SIZE];
+    int k = 0, failures = 0, size;
+
+    if (llopen(params(port, LlRx)) < 0)
+        return 1;
+
+    usleep(first_us);
+    while ((size = llread(packet)) >= 0) {
+        int want = size_of != NULL ? size_of(k) : fixed;
+        fillPacket(expected, k, want);
+        if (k >= count || size != want || memcmp(packet, expected, size) != 0) {
+            printf("FAIL: packet %d, %d bytes\n", k, size);
+            failures++;
+        }
+        k++;
+        usleep(wait_us);
+    }
+    llclose(TRUE);
+
+    if (k != count) {
+        printf("FAIL: %d packets received, %d sent\n", k, count);
+        failures++;
+    }
+    return failures;
+}
+
+// Write count packets of the given sizes (size_of(k), or fixed if it is
+// NULL) one llwrite at a time.
+// Returns 0 on success.
+static int writePackets(const char *port, int count, int (*size_of)(int), int fixed) {
+    static unsigned char packet[MAX_PAYLOAD_SIZE];
+
+    if (llopen(params(port, LlTx)) < 0)
+        return 1;
+
+    for (int k = 0; k < count; k++) {
+        int size = size_of != NULL ? size_of(k) : fixed;
+        fillPacket(packet, k, size);
+        if (llwrite(packet, size) != size) {
+            printf("FAIL: llwrite of packet %d\n", k);
+            llclose(FALSE);
+            return 1;
+        }
+    }
+
+    return llclose(TRUE) < 0;
+}
+
+// Batching: packets go out with llwritev, several per frame when they fit
+static int batchTransmitter(const char *port) {
+    static unsigned char packets[PACKETS][LONG_SIZE];
+    struct iovec iov[PER_CALL];
+
+    if (llopen(params(port, LlTx)) < 0)
+        return 1;
+
+    for (int k = 0; k < PACKETS; k += PER_CALL) {
+        int count = 0, total = 0;
+        for (int i = k; i < k + PER_CALL && i < PACKETS; i++) {
+            fillPacket(packets[i], i, packetSize(i));
+            iov[count].iov_base = packets[i];
+            iov[count].iov_len = packetSize(i);
+            total += packetSize(i);
+            count++;
+        }
+        if (llwritev(iov, count) != total) {
+            printf("FAIL: llwritev of packets %d to %d\n", k, k + count - 1);
+            llclose(FALSE);
+            return 1;
+        }
+    }
+
+    return llclose(TRUE) < 0;
+}
+
+static int batchReceiver(const char *port) {
+    return readPackets(port, PACKETS, packetSize, 0, 0, 0);
+}
+
+// Slow consumer: the ring fills up, the packets after it wait in the
+// receive buffer and each read must make room for them
+static int ringTransmitter(const char *port) {
+    return writePackets(port, RING_PACKETS, NULL, RING_SIZE);
+}
+
+static int ringReceiver(const char *port) {
+    return readPackets(port, RING_PACKETS, NULL, RING_SIZE, SLOW_START_US, SLOW_READ_US);
+}
+
+// The serial port of an original station, raw like the link layer sets it
+static int openRaw(const char *port) {
+    struct termios tio;
+    int fd = open(port, O_RDWR | O_NOCTTY);
+
+    if (fd < 0 || tcgetattr(fd, &tio) < 0) {
+        perror(port);
+        exit(1);
+    }
+    tio.c_iflag = 0;
+    tio.c_oflag = 0;
+    tio.c_lflag = 0;
+    tio.c_cflag = CS8 | CLOCAL | CREAD;
+    tio.c_cc[VTIME] = 0;
+    tio.c_cc[VMIN] = 1;
+    tcsetattr(fd, TCSANOW, &tio);
+    return fd;
+}
+
+// Read the next frame between two FLAGs, destuffed, into frame (size
+// bytes). Returns its length, or -1 once nothing came for LEGACY_TIMEOUT_MS.
+static int readFrame(int fd, unsigned char *frame, int size) {
+    static unsigned char buf[4096];
+    static int have = 0, at = 0, in_frame = FALSE;
+    int len = 0, escape = FALSE;
+
+    while (TRUE) {
+        if (at == have) {
+            struct pollfd pfd = {.fd = fd, .events = POLLIN};
+            int n;
+            if (poll(&pfd, 1, LEGACY_TIMEOUT_MS) <= 0 || (n = read(fd, buf, sizeof(buf))) <= 0)
+                return -1;
+            have = n;
+            at = 0;
+        }
+
+        unsigned char b = buf[at++];
+        if (b == FLAG) {
+            // The closing FLAG, unless the frame is empty: then it opens one
+            if (in_frame && len > 0)
+                return len;
+            in_frame = TRUE;
+            len = 0;
+            escape = FALSE;
+        } else if (!in_frame || len >= size) {
+            in_frame = FALSE;
+        } else if (b == ESC) {
+            escape = TRUE;
+        } else {
+            frame[len++] = escape ? b ^ 0x20 : b;
+            escape = FALSE;
+        }
+    }
+}
+
+static void sendSupervision(int fd, unsigned char a, unsigned char c) {
+    unsigned char frame[5] = {FLAG, a, c, a ^ c, FLAG};
+    if (write(fd, frame, sizeof(frame)) != sizeof(frame))
+        perror("write");
+}
+
+// I-frame of the original protocol: BCC2 is the XOR of the packet, and the
+// packet and BCC2 are stuffed
+static int informationFrame(unsigned char *frame, int ns, const unsigned char *packet, int size) {
+    unsigned char bcc2 = 0;
+    int n = 0;
+
+    frame[n++] = FLAG;
+    frame[n++] = A_TX;
+    frame[n++] = INF(ns);
+    frame[n++] = A_TX ^ INF(ns);
+    for (int i = 0; i <= size; i++) {
+        unsigned char b = i < size ? packet[i] : bcc2;
+        if (i < size)
+            bcc2 ^= b;
+        if (b == FLAG || b == ESC) {
+            frame[n++] = ESC;
+            b ^= 0x20;
+        }
+        frame[n++] = b;
+    }
+    frame[n++] = FLAG;
+    return n;
+}
+
+// Send frame until the reply with address a and control c comes back,
+// resending it at once for the control rej (-1 for none).
+// Returns TRUE once the reply came.
+static int command(int fd, const unsigned char *frame, int size, unsigned char a, unsigned char c, int rej) {
+    static unsigned char reply[MAX_PAYLOAD_SIZE + 8];
+
+    for (int tries = 0; tries < LEGACY_TRIES; tries++) {
+        if (write(fd, frame, size) != size)
+            return FALSE;
+
+        int len;
+        while ((len = readFrame(fd, reply, sizeof(reply))) >= 0) {
+            if (len != 3 || reply[0] != a || reply[2] != (reply[0] ^ reply[1]))
+                continue;
+            if (reply[1] == c)
+                return TRUE;
+            if (reply[1] == rej)
+                break;
+        }
+    }
+    return FALSE;
+}
+
+// Original receiver: a SET carrying parameters is not a frame it knows, so
+// only the bare SET sent after it is answered, with a bare UA. The link
+// must then keep to stop-and-wait, BCC2 and packets of LEGACY_SIZE bytes.
+static int legacyReceiver(const char *port) {
+    static unsigned char frame[MAX_PAYLOAD_SIZE + 8], expected[LEGACY_SIZE];
+    int fd = openRaw(port);
+    int k = 0, ns = 0, closed = FALSE, failures = 0, len;
+
+    while (!closed && (len = readFrame(fd, frame, sizeof(frame))) >= 0) {
+        if (len < 3 || frame[2] != (frame[0] ^ frame[1]))
+            continue;
+        unsigned char a = frame[0], c = frame[1];
+
+        if (a == A_TX && c == SET) {
+            if (len == 3)
+                sendSupervision(fd, A_RX, UA);
+        } else if (a == A_TX && (c == INF(0) || c == INF(1)) && len > 3) {
+            unsigned char bcc2 = 0;
+            for (int i = 3; i < len; i++)
+                bcc2 ^= frame[i];
+
+            if (bcc2 != 0) {
+                sendSupervision(fd, A_TX, REJ(ns));
+                continue;
+            }
+            // A repeated frame is acknowledged again and dropped
+            if (c == INF(ns)) {
+                int size = len - 4, want = legacySize(k);
+                fillPacket(expected, k, want);
+                if (k >= LEGACY_PACKETS || size != want || memcmp(frame + 3, expected, size) != 0) {
+                    printf("FAIL: packet %d, %d bytes\n", k, size);
+                    failures++;
+                }
+                k++;
+                ns ^= 1;
+            }
+            sendSupervision(fd, A_TX, RR(ns));
+        } else if (a == A_TX && c == DISC) {
+            sendSupervision(fd, A_RX, DISC);
+        } else if (a == A_RX && c == UA) {
+            closed = TRUE;
+        } else {
+            printf("FAIL: frame with address 0x%02X and control 0x%02X\n", a, c);
+            failures++;
+        }
+    }
+    close(fd);
+
+    if (!closed) {
+        printf("FAIL: no UA to the DISC\n");
+        failures++;
+    }
+    if (k != LEGACY_PACKETS) {
+        printf("FAIL: %d packets received, %d sent\n", k, LEGACY_PACKETS);
+        failures++;
+    }
+    return failures;
+}
+
+static int legacyWriter(const char *port) {
+    return writePackets(port, LEGACY_PACKETS, legacySize, 0);
+}
+
+// Original transmitter: a bare SET, stop-and-wait I-frames, then DISC
+static int legacyTransmitter(const char *port) {
+    static unsigned char packet[LEGACY_SIZE], frame[2 * LEGACY_SIZE + 8];
+    unsigned char set[5] = {FLAG, A_TX, SET, A_TX ^ SET, FLAG};
+    unsigned char disc[5] = {FLAG, A_TX, DISC, A_TX ^ DISC, FLAG};
+    int fd = openRaw(port);
+
+    if (!command(fd, set, sizeof(set), A_RX, UA, -1)) {
+        printf("FAIL: no UA to the SET\n");
+        return 1;
+    }
+
+    for (int k = 0; k < LEGACY_PACKETS; k++) {
+        int ns = k % 2;
+        fillPacket(packet, k, legacySize(k));
+        int size = informationFrame(frame, ns, packet, legacySize(k));
+        if (!command(fd, frame, size, A_TX, RR(1 - ns), REJ(ns))) {
+            printf("FAIL: packet %d not acknowledged\n", k);
+            return 1;
+        }
+    }
+
+    if (!command(fd, disc, sizeof(disc), A_RX, DISC, -1)) {
+        printf("FAIL: no DISC to the DISC\n");
+        return 1;
+    }
+    sendSupervision(fd, A_RX, UA);
+    tcdrain(fd);
+    close(fd);
+    return 0;
+}
+
+static int legacyReader(const char *port) {
+    return readPackets(port, LEGACY_PACKETS, legacySize, 0, 0, 0);
+}
+
+typedef struct {
+    const char *name;
+    int (*transmitter)(const char *port);   /* Return 0 on success */
+    int (*receiver)(const char *port);      /* Return the number of failures */
+} link_case;
+
+static const link_case cases[] = {
+    {"batching", batchTransmitter, batchReceiver},
+    {"slow consumer", ringTransmitter, ringReceiver},
+    {"original receiver", legacyWriter, legacyReceiver},
+    {"original transmitter", legacyTransmitter, legacyReader},
+};
+
+// Run f in a child process, killed if it hangs
+static pid_t spawn(int (*f)(const char *), const char *port) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        alarm(CASE_TIMEOUT_S);
+        exit(f(port) == 0 ? 0 : 1);
+    }
+    return pid;
+}
+
+static int passed(pid_t pid) {
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+// Returns TRUE if both ends succeeded
+static int runCase(const link_case *c) {
+    char tx_port[64] = {0}, rx_port[64] = {0};
+    int tx_slave, rx_slave;
+    int tx_master = openPty(tx_port, sizeof(tx_port), &tx_slave);
+    int rx_master = openPty(rx_port, sizeof(rx_port), &rx_slave);
+
+    fflush(stdout);
+    pid_t relay_pid = fork();
+    if (relay_pid == 0) {
+        relay(tx_master, rx_master);
+        _exit(0);
+    }
+
+    pid_t rx_pid = spawn(c->receiver, rx_port);
+    // Only the first SET offers the link parameters: the receiver must be listening
+    usleep(RX_START_US);
+    pid_t tx_pid = spawn(c->transmitter, tx_port);
+
+    int ok = passed(tx_pid);
+    ok = passed(rx_pid) && ok;
+    kill(relay_pid, SIGTERM);
+    waitpid(relay_pid, NULL, 0);
+    close(tx_master);
+    close(rx_master);
+    close(tx_slave);
+    close(rx_slave);
+
+    printf("%s: %s\n", c->name, ok ? "passed" : "FAILED");
+    return ok;
+}
+
+int main() {
+    int failures = 0;
+
+    for (int i = 0; i < (int) (sizeof(cases) / sizeof(cases[0])); i++)
+        failures += !runCase(&cases[i]);
+
+    if (failures > 0) {
+        printf("%d link cases failed\n", failures);
+        return 1;
+    }
+    printf("All link cases passed\n");
+    return 0;
+}
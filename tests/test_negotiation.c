@@ -0,0 +1,229 @@
+// Link parameter negotiation test: blocks must decode to the parameters and
+// packet they were encoded from, end in a CRC-16 over the entries, be
+// rejected when damaged or malformed, skip entries of unknown types and
+// leave missing ones alone, and paramsAgree() must pick one value of each.
+
+#include "negotiation.h"
+#include "fcs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUNDS 1000
+#define MAX_SEQ_BITS 7
+
+static int failures = 0;
+
+static void fail(const char *what, int round) {
+    printf("FAIL: %s, round %d\n", what, round);
+    failures++;
+}
+
+static void randomParams(link_params *p) {
+    p->arq = rand() & 0xFF;
+    p->fcs = rand() & 0xFF;
+    p->fec = rand() & 0xFF;
+    p->compression = rand() & 0xFF;
+    p->framing = rand() & 0xFF;
+    p->scrambling = rand() & 0xFF;
+    p->batching = rand() & 0xFF;
+    p->handshake_data = rand() & 0xFF;
+    p->keepalive = rand() & 0xFF;
+    p->seq_bits = 1 + rand() % MAX_SEQ_BITS;
+    p->window = 1 + rand() % 255;
+    p->max_payload = 1 + rand() % 65535;
+}
+
+// Append the CRC-16 to len bytes of entries. Returns the block size.
+static int sign(unsigned char *block, int len) {
+    fcsStore(FCS_CRC16, fcsUpdate(FCS_CRC16, fcsInit(FCS_CRC16), block, len), block + len);
+    return len + fcsSize(FCS_CRC16);
+}
+
+// Parameters and packet come back as they were, and the block ends in the
+// CRC-16 of the entries before it
+static void checkRoundTrip(int round) {
+    static unsigned char block[NEGOTIATION_MAX_SIZE], data[NEG_DATA_MAX], out[NEG_DATA_MAX];
+    link_params p, got;
+    int size = rand() % 3 == 0 ? 0 : rand() % (NEG_DATA_MAX + 1);
+    int with_params = round % 4 != 3, with_data = round % 2 == 0;
+
+    randomParams(&p);
+    randomParams(&got);
+    for (int i = 0; i < size; i++)
+        data[i] = rand();
+
+    int len = paramsEncode(with_params ? &p : NULL, with_data ? data : NULL, size, block);
+    if (len < fcsSize(FCS_CRC16) || len > NEGOTIATION_MAX_SIZE) {
+        fail("block size", round);
+        return;
+    }
+
+    unsigned char check[FCS_MAX_SIZE];
+    int end = len - fcsSize(FCS_CRC16);
+    fcsStore(FCS_CRC16, fcsUpdate(FCS_CRC16, fcsInit(FCS_CRC16), block, end), check);
+    if (memcmp(block + end, check, fcsSize(FCS_CRC16)) != 0)
+        fail("CRC-16 over the block", round);
+
+    link_params expected = with_params ? p : got;
+    if (paramsDecode(&got, block, len) < 0 || memcmp(&got, &expected, sizeof(got)) != 0)
+        fail("paramsDecode", round);
+
+    int res = paramsData(block, len, out);
+    if (with_data ? res != size || memcmp(out, data, size) != 0 : res != -1)
+        fail("paramsData", round);
+}
+
+// Any single bit flipped fails the CRC and leaves the parameters alone
+static void checkDamage(int round) {
+    static unsigned char block[NEGOTIATION_MAX_SIZE], out[NEG_DATA_MAX];
+    link_params p, got, before;
+    unsigned char data[32];
+
+    randomParams(&p);
+    randomParams(&got);
+    before = got;
+    int len = paramsEncode(&p, data, sizeof(data), block);
+
+    int bit = rand() % (8 * len);
+    block[bit / 8] ^= 1 << (bit % 8);
+    if (paramsDecode(&got, block, len) != -1 || memcmp(&got, &before, sizeof(got)) != 0)
+        fail("damaged block decoded", round);
+    if (paramsData(block, len, out) != -1)
+        fail("data of a damaged block", round);
+
+    // Too short to hold the CRC
+    if (paramsDecode(&got, block, rand() % fcsSize(FCS_CRC16)) != -1)
+        fail("block shorter than its CRC decoded", round);
+}
+
+// Entries cut short or out of range are rejected even with a good CRC
+static void checkMalformed() {
+    unsigned char block[16], out[NEG_DATA_MAX];
+    link_params p, before;
+
+    randomParams(&p);
+    before = p;
+
+    // A length running past the end of the block
+    block[0] = NEG_WINDOW;
+    block[1] = 2;
+    block[2] = 4;
+    if (paramsDecode(&p, block, sign(block, 3)) != -1 || paramsData(block, 5, out) != -1)
+        fail("entry longer than the block decoded", 0);
+
+    // A type with no length after it
+    block[0] = NEG_WINDOW;
+    block[1] = 1;
+    block[2] = 4;
+    block[3] = NEG_FCS;
+    if (paramsDecode(&p, block, sign(block, 4)) != -1)
+        fail("entry without length decoded", 0);
+
+    // Values the link cannot use
+    static const unsigned char bad[][4] = {
+        {NEG_SEQ_BITS, 1, 0}, {NEG_SEQ_BITS, 1, MAX_SEQ_BITS + 1}, {NEG_WINDOW, 1, 0}, {NEG_MAX_PAYLOAD, 2, 0, 0},
+    };
+    for (int i = 0; i < (int) (sizeof(bad) / sizeof(bad[0])); i++) {
+        int len = 2 + bad[i][1];
+        memcpy(block, bad[i], len);
+        if (paramsDecode(&p, block, sign(block, len)) != -1)
+            fail("value out of range decoded", i);
+    }
+
+    if (memcmp(&p, &before, sizeof(p)) != 0)
+        fail("rejected block changed the parameters", 0);
+}
+
+// Entries of types this station does not know are skipped, wherever they
+// are and however long, and missing entries keep the values given
+static void checkUnknown(int round) {
+    static unsigned char block[NEGOTIATION_MAX_SIZE + 300], longer[NEGOTIATION_MAX_SIZE + 300];
+    unsigned char data[16], out[NEG_DATA_MAX];
+    link_params p, got;
+
+    randomParams(&p);
+    randomParams(&got);
+    for (int i = 0; i < (int) sizeof(data); i++)
+        data[i] = rand();
+    int len = paramsEncode(&p, data, sizeof(data), block) - fcsSize(FCS_CRC16);
+
+    // Insert one unknown entry at an entry boundary
+    int at = 0, skip = rand() % 12;
+    for (int i = 0; i < skip && at < len; i++)
+        at += 2 + block[at + 1];
+    int size = rand() % 256;
+    memcpy(longer, block, at);
+    longer[at] = 200 + rand() % 56;
+    longer[at + 1] = size;
+    for (int i = 0; i < size; i++)
+        longer[at + 2 + i] = rand();
+    memcpy(longer + at + 2 + size, block + at, len - at);
+    len = sign(longer, len + 2 + size);
+
+    if (paramsDecode(&got, longer, len) < 0 || memcmp(&got, &p, sizeof(got)) != 0)
+        fail("unknown entry not skipped", round);
+    if (paramsData(longer, len, out) != (int) sizeof(data) || memcmp(out, data, sizeof(data)) != 0)
+        fail("unknown entry not skipped by paramsData", round);
+
+    // A block with only the window: the rest keep what got had
+    link_params expected = got;
+    expected.window = 1 + rand() % 255;
+    block[0] = NEG_WINDOW;
+    block[1] = 1;
+    block[2] = expected.window;
+    if (paramsDecode(&got, block, sign(block, 3)) < 0 || memcmp(&got, &expected, sizeof(got)) != 0)
+        fail("missing entries changed", round);
+}
+
+static void checkAgree() {
+    // A station with everything, and one that only has the original protocol
+    link_params full = {
+        .arq = 0x7, .fcs = 0xF, .fec = 0x3, .compression = 0x3, .framing = 0x3, .scrambling = 0x3,
+        .batching = 0x3, .handshake_data = 0x3, .keepalive = 0x3, .seq_bits = 3, .window = 4, .max_payload = 4096,
+    };
+    link_params legacy = {
+        .arq = 0x1, .fcs = 0x1, .fec = 0x1, .compression = 0x1, .framing = 0x1, .scrambling = 0x1,
+        .batching = 0x1, .handshake_data = 0x1, .keepalive = 0x1, .seq_bits = 1, .window = 1, .max_payload = 1000,
+    };
+    link_params agreed;
+
+    if (paramsAgree(&full, &full, &agreed) < 0 || paramsValue(agreed.arq) != 2 || paramsValue(agreed.fcs) != 3
+        || paramsValue(agreed.fec) != 0 || paramsValue(agreed.framing) != 1 || agreed.window != 4)
+        fail("paramsAgree with every value", 0);
+
+    // Whichever end asks, the original protocol is all they share
+    if (paramsAgree(&full, &legacy, &agreed) < 0 || memcmp(&agreed, &legacy, sizeof(agreed)) != 0)
+        fail("paramsAgree with the original protocol", 0);
+    if (paramsAgree(&legacy, &full, &agreed) < 0 || memcmp(&agreed, &legacy, sizeof(agreed)) != 0)
+        fail("paramsAgree with the original protocol", 1);
+
+    // FEC is used when one end leaves FEC_NONE out
+    link_params fec_only = full;
+    fec_only.fec = 0x2;
+    if (paramsAgree(&full, &fec_only, &agreed) < 0 || paramsValue(agreed.fec) != 1)
+        fail("paramsAgree with FEC required", 0);
+
+    // No common value
+    if (paramsAgree(&legacy, &fec_only, &agreed) != -1)
+        fail("paramsAgree without a common FEC", 0);
+}
+
+int main() {
+    srand(1);
+    for (int round = 0; round < ROUNDS; round++) {
+        checkRoundTrip(round);
+        checkDamage(round);
+        checkUnknown(round);
+    }
+    checkMalformed();
+    checkAgree();
+
+    if (failures > 0) {
+        printf("%d negotiation checks failed\n", failures);
+        return 1;
+    }
+    printf("All negotiation checks passed\n");
+    return 0;
+}
@@ -0,0 +1,168 @@
+// Byte stuffing engine test: every vector kernel the CPU has must match
+// the scalar one byte for byte, stuffVector() must describe the same
+// bytes and the destuffer must give the data back, for ESC and COBS
+// framing alike.
+
+#include "../src/stuffing.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define MAX_LEN 4200
+
+static int failures = 0;
+
+static void fail(const char *what, const char *pattern, int len) {
+    printf("FAIL: %s, %s data, %d bytes\n", what, pattern, len);
+    failures++;
+}
+
+// Stuff data with kernel k and compare output and BCC with the scalar kernel
+static void compareKernel(stuff_kernel k, const char *name, const unsigned char *data, int len,
+                          const char *pattern) {
+    static unsigned char expected[2 * MAX_LEN], got[2 * MAX_LEN];
+    unsigned char bcc_expected = 0x5A, bcc_got = 0x5A;
+
+    int n_expected = stuffScalar(expected, data, len, &bcc_expected);
+    int n_got = k(got, data, len, &bcc_got);
+
+    if (n_got != n_expected || memcmp(got, expected, n_expected) != 0)
+        fail(name, pattern, len);
+    else if (bcc_got != bcc_expected)
+        fail(name, pattern, len);
+}
+
+// stuffVector() must describe the bytes stuffBytes() writes, and
+// destuffBytes() must undo them
+static void checkVectorAndDestuff(const unsigned char *data, int len, const char *pattern) {
+    static unsigned char stuffed[2 * MAX_LEN + 1], gathered[2 * MAX_LEN], out[MAX_LEN];
+    static struct iovec iov[2 * MAX_LEN + 1];
+    unsigned char bcc = 0;
+
+    int size = stuffBytes(stuffed, data, len, &bcc);
+
+    int n = stuffVector(iov, data, len);
+    int g = 0;
+    for (int i = 0; i < n; i++) {
+        memcpy(gathered + g, iov[i].iov_base, iov[i].iov_len);
+        g += iov[i].iov_len;
+    }
+    if (g != size || memcmp(gathered, stuffed, size) != 0)
+        fail("stuffVector", pattern, len);
+
+    destuffer d;
+    destuff_status status;
+    stuffed[size] = STUFF_FLAG;
+    destuffInit(&d, out, MAX_LEN, FCS_XOR, FRAMING_ESCAPE);
+    int used = destuffBytes(&d, stuffed, size + 1, &status);
+    if (status != DESTUFF_FRAME_END || used != size + 1 || d.size != len || memcmp(out, data, len) != 0)
+        fail("destuffBytes", pattern, len);
+    else if (d.check != fcsUpdate(FCS_XOR, fcsInit(FCS_XOR), data, len))
+        fail("destuffBytes check", pattern, len);
+}
+
+// COBS: the encoder, fed in two pieces, must leave no FLAG in the frame and
+// destuffBytes() must decode it however the frame is split between calls
+static void checkCobs(const unsigned char *data, int len, const char *pattern) {
+    static unsigned char encoded[COBS_MAX_SIZE(MAX_LEN) + 1], out[MAX_LEN];
+    int split = rand() % (len + 1);
+    cobs_encoder e;
+
+    cobsEncodeInit(&e, encoded);
+    cobsEncodeUpdate(&e, data, split);
+    cobsEncodeUpdate(&e, data + split, len - split);
+    int size = cobsEncodeFinal(&e);
+    if (size > COBS_MAX_SIZE(len) || memchr(encoded, STUFF_FLAG, size) != NULL) {
+        fail("cobsEncode", pattern, len);
+        return;
+    }
+    encoded[size] = STUFF_FLAG;
+
+    for (int at = 0; at <= size; at++) {
+        destuffer d;
+        destuff_status status;
+
+        destuffInit(&d, out, MAX_LEN, FCS_XOR, FRAMING_COBS);
+        int used = destuffBytes(&d, encoded, at, &status);
+        if (status != DESTUFF_MORE || used != at) {
+            fail("destuffBytes cobs, first piece", pattern, len);
+            return;
+        }
+        used = destuffBytes(&d, encoded + at, size + 1 - at, &status);
+        if (status != DESTUFF_FRAME_END || used != size + 1 - at || d.size != len ||
+            memcmp(out, data, len) != 0) {
+            fail("destuffBytes cobs", pattern, len);
+            return;
+        }
+        if (d.check != fcsUpdate(FCS_XOR, fcsInit(FCS_XOR), data, len)) {
+            fail("destuffBytes cobs check", pattern, len);
+            return;
+        }
+    }
+}
+
+static void fill(unsigned char *data, int len, int pattern) {
+    for (int i = 0; i < len; i++) {
+        switch (pattern) {
+            case 0: data[i] = rand(); break;
+            case 1: data[i] = STUFF_FLAG; break;
+            case 2: data[i] = STUFF_ESC; break;
+            case 3: data[i] = i & 1 ? STUFF_FLAG : STUFF_ESC; break;
+            case 4: data[i] = 1 + rand() % 255; break;
+            // Runs of 254 and of 255 non-zero bytes, each ended by a zero
+            case 5: data[i] = i % 255 == 254 ? 0 : 1 + rand() % 255; break;
+            case 6: data[i] = i % 256 == 255 ? 0 : 1 + rand() % 255; break;
+            default: data[i] = rand() % 4 == 0 ? STUFF_FLAG + rand() % 2 - 1 : rand(); break;
+        }
+    }
+}
+
+int main() {
+    static const char *patterns[] = {"random", "all-FLAG", "all-ESC", "FLAG/ESC", "non-zero",
+                                     "254-runs", "255-runs", "mixed"};
+    int n_patterns = sizeof(patterns) / sizeof(patterns[0]);
+    static unsigned char data[MAX_LEN];
+
+    // Every length up to a few vectors, around the COBS run limits, then
+    // around the vector boundaries of long payloads
+    int lengths[200];
+    int count = 0;
+    for (int len = 0; len <= 100; len++)
+        lengths[count++] = len;
+    for (int len = 253; len <= 256; len++)
+        lengths[count++] = len;
+    for (int len = 508; len <= 511; len++)
+        lengths[count++] = len;
+    for (int base = 128; base <= 4096; base *= 2)
+        for (int d = -1; d <= 1; d++)
+            lengths[count++] = base + d;
+    lengths[count++] = MAX_LEN;
+
+    srand(1);
+    selectKernel();
+    printf("Stuffing engine: %s\n", kernel_name);
+
+    for (int p = 0; p < n_patterns; p++) {
+        for (int i = 0; i < count; i++) {
+            int len = lengths[i];
+            fill(data, len, p);
+
+#ifdef HAVE_X86_KERNELS
+            if (__builtin_cpu_supports("sse2"))
+                compareKernel(stuffSSE2, "sse2", data, len, patterns[p]);
+            if (__builtin_cpu_supports("avx2"))
+                compareKernel(stuffAVX2, "avx2", data, len, patterns[p]);
+#endif
+            compareKernel(kernel, kernel_name, data, len, patterns[p]);
+            checkVectorAndDestuff(data, len, patterns[p]);
+            checkCobs(data, len, patterns[p]);
+        }
+    }
+
+    if (failures > 0) {
+        printf("%d stuffing checks failed\n", failures);
+        return 1;
+    }
+    printf("All stuffing checks passed\n");
+    return 0;
+}